@@ -0,0 +1,316 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Storage backend for the AVR's internal EEPROM.
+
+ Writes skip unchanged bytes, and use the write-only programming mode where
+ the erase isn't needed. With EEPROM_FS_ASYNC, writes are queued and
+ written in the background by the EE_READY interrupt.
+ */
+
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include <stdint.h>
+
+#include "eeprom-fs-backend.h"
+
+void avr_read(void* dst, const void* src, size_t n);
+void avr_write(const void* src, void* dst, size_t n);
+void avr_update(const void* src, void* dst, size_t n);
+void avr_sync(void);
+uint8_t avr_pending(void);
+void program_byte(uint8_t* addr, uint8_t value, uint8_t old);
+
+const fs_backend_t avr_eeprom_backend =
+{
+	avr_read,
+	avr_write,
+	avr_update,
+	avr_sync,
+	avr_pending,
+	0xFF
+};
+
+#if EEPROM_FS_ASYNC
+/*
+ * Queue of bytes waiting to be written by the EE_READY interrupt
+ */
+typedef struct queued_byte
+{
+	uint16_t addr;
+	uint8_t value;
+} queued_byte_t;
+
+#define QUEUE_MASK (EEPROM_FS_ASYNC_QUEUE_SIZE - 1)
+
+queued_byte_t write_queue[EEPROM_FS_ASYNC_QUEUE_SIZE];
+volatile uint8_t queue_head = 0;
+volatile uint8_t queue_tail = 0;
+void (*volatile write_callback)(void) = NULL;
+
+void queue_byte(uint8_t* addr, uint8_t value);
+uint8_t queue_overlaps(const void* addr, size_t n);
+#endif
+
+/**
+ * Read a block of memory from EEPROM.
+ * With asynchronous writes, any queued writes to the same addresses are
+ * finished first, so the data read back is always up to date.
+ *
+ * \param dst Buffer to read into
+ * \param src EEPROM address to read from
+ * \param n Number of bytes to read
+ */
+void avr_read(void* dst, const void* src, size_t n)
+{
+#if EEPROM_FS_ASYNC
+	if (queue_overlaps(src, n))
+	{
+		avr_sync();
+	}
+
+	// Stop the queue starting a write part way through the read
+	EECR &= ~_BV(EERIE);
+	eeprom_busy_wait();
+	eeprom_read_block(dst, src, n);
+	if (queue_head != queue_tail)
+	{
+		EECR |= _BV(EERIE);
+	}
+#else
+	eeprom_read_block(dst, src, n);
+#endif
+}
+
+/**
+ * Write a block of memory to EEPROM, programming every byte
+ *
+ * \param src Data to write
+ * \param dst EEPROM address to write to
+ * \param n Number of bytes to write
+ */
+void avr_write(const void* src, void* dst, size_t n)
+{
+	// Queued writes would land on top of this one
+	avr_sync();
+
+	eeprom_write_block(src, dst, n);
+	write_stats.bytes_written += n;
+}
+
+/**
+ * Write a block of memory to EEPROM, only programming the bytes that differ
+ * from what is already stored.
+ *
+ * \param src Data to write
+ * \param dst EEPROM address to write to
+ * \param n Number of bytes to write
+ */
+void avr_update(const void* src, void* dst, size_t n)
+{
+	const uint8_t* data = (const uint8_t*) src;
+	uint8_t* addr = (uint8_t*) dst;
+
+#if EEPROM_FS_ASYNC
+	// Unchanged bytes are skipped by the interrupt once the EEPROM is free to read
+	for (size_t i = 0; i < n; i++)
+	{
+		queue_byte(addr + i, data[i]);
+	}
+#else
+	for (size_t i = 0; i < n; i++)
+	{
+		uint8_t old = eeprom_read_byte(addr + i);
+		if (old == data[i])
+		{
+			write_stats.bytes_skipped++;
+		}
+		else
+		{
+			program_byte(addr + i, data[i], old);
+		}
+	}
+#endif
+}
+
+/**
+ * Wait until every queued write has reached EEPROM
+ */
+void avr_sync(void)
+{
+#if EEPROM_FS_ASYNC
+	while (queue_head != queue_tail)
+		;
+#endif
+	eeprom_busy_wait();
+}
+
+/**
+ * Returns the number of bytes waiting to be written to EEPROM
+ */
+uint8_t avr_pending(void)
+{
+#if EEPROM_FS_ASYNC
+	return (queue_head - queue_tail) & QUEUE_MASK;
+#else
+	return 0;
+#endif
+}
+
+#if EEPROM_FS_ASYNC
+/**
+ * Add a byte to the write queue, waiting for space if the queue is full.
+ * Global interrupts must be enabled.
+ *
+ * \param addr EEPROM address to write to
+ * \param value Value to write
+ */
+void queue_byte(uint8_t* addr, uint8_t value)
+{
+	uint8_t next = (queue_head + 1) & QUEUE_MASK;
+	while (next == queue_tail)
+		;
+
+	write_queue[queue_head].addr = (uint16_t) (uintptr_t) addr;
+	write_queue[queue_head].value = value;
+	queue_head = next;
+
+	// EE_READY fires straight away if the EEPROM is idle
+	EECR |= _BV(EERIE);
+}
+
+/**
+ * Returns whether any queued byte falls within a range of EEPROM addresses
+ *
+ * \param addr Start of the range
+ * \param n Length of the range
+ */
+uint8_t queue_overlaps(const void* addr, size_t n)
+{
+	uint16_t start = (uint16_t) (uintptr_t) addr;
+
+	for (uint8_t i = queue_tail; i != queue_head; i = (i + 1) & QUEUE_MASK)
+	{
+		if (write_queue[i].addr >= start && write_queue[i].addr < start + n)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Write the next changed byte in the queue. Fires whenever the EEPROM is
+ * ready while the queue is not empty.
+ */
+ISR(EE_READY_vect)
+{
+	while (queue_tail != queue_head)
+	{
+		queued_byte_t next = write_queue[queue_tail];
+		queue_tail = (queue_tail + 1) & QUEUE_MASK;
+
+		EEAR = next.addr;
+		EECR |= _BV(EERE);
+		uint8_t old = EEDR;
+
+		if (old == next.value)
+		{
+			write_stats.bytes_skipped++;
+			continue;
+		}
+
+		uint8_t mode = 0;
+#if EEPROM_FS_WRITE_ONLY && defined(EEPM1)
+		if ((old & next.value) == next.value)
+		{
+			// Write-only programming mode
+			mode = _BV(EEPM1);
+			write_stats.bytes_write_only++;
+		}
+		else
+#endif
+		{
+			write_stats.bytes_written++;
+		}
+
+		EEDR = next.value;
+		EECR = _BV(EERIE) | mode;
+		EECR |= _BV(EEMPE);
+		EECR |= _BV(EEPE);
+		return;
+	}
+
+	// Queue is empty
+	EECR &= ~_BV(EERIE);
+	if (write_callback != NULL)
+	{
+		write_callback();
+	}
+}
+#endif
+
+/**
+ * Set a function to be called from the EE_READY interrupt each time the
+ * write queue empties
+ */
+void set_write_callback(void (*callback)(void))
+{
+#if EEPROM_FS_ASYNC
+	write_callback = callback;
+#endif
+}
+
+/**
+ * Program a single byte of EEPROM.
+ * If the new value only clears bits of the old one (such as writing over an
+ * erased 0xFF cell), the erase is skipped, roughly halving the write time.
+ *
+ * \param addr EEPROM address to write to
+ * \param value Value to write
+ * \param old Value currently stored at the address
+ */
+void program_byte(uint8_t* addr, uint8_t value, uint8_t old)
+{
+#if EEPROM_FS_WRITE_ONLY && defined(EEPM1)
+	if ((old & value) == value)
+	{
+		// Write-only programming mode
+		eeprom_busy_wait();
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			EEAR = (uint16_t) (uintptr_t) addr;
+			EEDR = value;
+			EECR = _BV(EEPM1);
+			EECR |= _BV(EEMPE);
+			EECR |= _BV(EEPE);
+		}
+		write_stats.bytes_write_only++;
+		return;
+	}
+#endif
+
+	// Erase and write
+	eeprom_write_byte(addr, value);
+	write_stats.bytes_written++;
+}
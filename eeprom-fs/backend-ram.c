@@ -0,0 +1,166 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Storage backend for an EEPROM image held in RAM.
+
+ Useful for running the filesystem on a host machine, or for scratch
+ storage on a device. On a host, the image can be loaded from and saved to
+ a file.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "eeprom-fs-backend.h"
+
+void ram_read(void* dst, const void* src, size_t n);
+void ram_write(const void* src, void* dst, size_t n);
+void ram_update(const void* src, void* dst, size_t n);
+void ram_sync(void);
+
+#define RAM_ERASED_VALUE 0xFF
+
+const fs_backend_t ram_backend =
+{
+	ram_read,
+	ram_write,
+	ram_update,
+	ram_sync,
+	NULL,
+	RAM_ERASED_VALUE
+};
+
+uint8_t ram_eeprom[EEPROM_FS_START + EEPROM_FS_SIZE];
+
+/**
+ * Read a block of memory from the RAM image
+ *
+ * \param dst Buffer to read into
+ * \param src Image address to read from
+ * \param n Number of bytes to read
+ */
+void ram_read(void* dst, const void* src, size_t n)
+{
+	memcpy(dst, &ram_eeprom[(uintptr_t) src], n);
+}
+
+/**
+ * Write a block of memory to the RAM image
+ *
+ * \param src Data to write
+ * \param dst Image address to write to
+ * \param n Number of bytes to write
+ */
+void ram_write(const void* src, void* dst, size_t n)
+{
+	memcpy(&ram_eeprom[(uintptr_t) dst], src, n);
+	write_stats.bytes_written += n;
+}
+
+/**
+ * Write a block of memory to the RAM image, counting the bytes that would
+ * have been skipped or written without an erase on a real EEPROM
+ *
+ * \param src Data to write
+ * \param dst Image address to write to
+ * \param n Number of bytes to write
+ */
+void ram_update(const void* src, void* dst, size_t n)
+{
+	const uint8_t* data = (const uint8_t*) src;
+	uint8_t* cell = &ram_eeprom[(uintptr_t) dst];
+
+	for (size_t i = 0; i < n; i++)
+	{
+		if (cell[i] == data[i])
+		{
+			write_stats.bytes_skipped++;
+			continue;
+		}
+
+		if ((cell[i] & data[i]) == data[i])
+		{
+			write_stats.bytes_write_only++;
+		}
+		else
+		{
+			write_stats.bytes_written++;
+		}
+		cell[i] = data[i];
+	}
+}
+
+/**
+ * Writes to the RAM image are never deferred
+ */
+void ram_sync(void)
+{
+}
+
+/**
+ * Fill the RAM image with erased bytes
+ */
+void ram_backend_erase()
+{
+	memset(ram_eeprom, RAM_ERASED_VALUE, sizeof(ram_eeprom));
+}
+
+#ifndef __AVR__
+/**
+ * Load the RAM image from a file
+ *
+ * \param path File to load
+ * \return 0 on success, -1 if the file couldn't be read
+ */
+int ram_backend_load(const char* path)
+{
+	FILE* f = fopen(path, "rb");
+	if (f == NULL)
+	{
+		return -1;
+	}
+
+	size_t n = fread(ram_eeprom, 1, sizeof(ram_eeprom), f);
+	fclose(f);
+
+	return n == sizeof(ram_eeprom) ? 0 : -1;
+}
+
+/**
+ * Save the RAM image to a file
+ *
+ * \param path File to save to
+ * \return 0 on success, -1 if the file couldn't be written
+ */
+int ram_backend_save(const char* path)
+{
+	FILE* f = fopen(path, "wb");
+	if (f == NULL)
+	{
+		return -1;
+	}
+
+	size_t n = fwrite(ram_eeprom, 1, sizeof(ram_eeprom), f);
+	fclose(f);
+
+	return n == sizeof(ram_eeprom) ? 0 : -1;
+}
+#endif
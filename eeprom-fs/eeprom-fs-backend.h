@@ -0,0 +1,123 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Storage backends for eeprom-fs.
+
+ The filesystem never touches storage directly. Every read and write goes
+ through the operations of the current backend, so the same filesystem can
+ run on the AVR's internal EEPROM, an external I2C/SPI part, FRAM, or a
+ RAM image on a host machine.
+
+ Addresses are passed as pointers in the same way as avr-libc's
+ eeprom_*_block() functions, counting from 0 at the start of the device.
+
+ Writes can be of any length and start anywhere. A backend for a part
+ written a page at a time splits them on its page boundaries itself.
+ */
+
+#ifndef EEPROM_FS_BACKEND_H_
+#define EEPROM_FS_BACKEND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "eeprom-fs.h"
+
+typedef struct fs_backend
+{
+	/*
+	 * Read n bytes from storage
+	 */
+	void (*read)(void* dst, const void* src, size_t n);
+	/*
+	 * Write n bytes to storage, programming every byte
+	 */
+	void (*write)(const void* src, void* dst, size_t n);
+	/*
+	 * Write n bytes to storage, only programming the bytes that differ from
+	 * what is already stored
+	 */
+	void (*update)(const void* src, void* dst, size_t n);
+	/*
+	 * Wait until all writes have reached storage
+	 */
+	void (*sync)(void);
+	/*
+	 * Number of bytes still waiting to be written, or NULL if writes are
+	 * never deferred
+	 */
+	uint8_t (*pending)(void);
+	/*
+	 * Value of a byte after it has been erased
+	 */
+	uint8_t erased_value;
+} fs_backend_t;
+
+/*
+ * Counters of the diff-aware writer, kept up to date by each backend's
+ * update operation
+ */
+extern volatile fs_write_stats_t write_stats;
+
+/**
+ * Set the storage backend used by the filesystem.
+ * Must be called before #init_eepromfs().
+ */
+void set_backend(const fs_backend_t* backend);
+
+#ifdef __AVR__
+/*
+ * The AVR's internal EEPROM
+ */
+extern const fs_backend_t avr_eeprom_backend;
+
+/**
+ * Set a function to call each time the write queue empties.
+ * The callback runs inside the EE_READY interrupt.
+ * Only used when EEPROM_FS_ASYNC is enabled.
+ */
+void set_write_callback(void (*callback)(void));
+#endif
+
+/*
+ * An EEPROM image held in RAM, EEPROM_FS_START + EEPROM_FS_SIZE bytes long
+ */
+extern const fs_backend_t ram_backend;
+extern uint8_t ram_eeprom[];
+
+/**
+ * Fill the RAM image with erased bytes
+ */
+void ram_backend_erase();
+
+#ifndef __AVR__
+/**
+ * Load the RAM image from a file.
+ * Returns 0 on success.
+ */
+int ram_backend_load(const char* path);
+/**
+ * Save the RAM image to a file.
+ * Returns 0 on success.
+ */
+int ram_backend_save(const char* path);
+#endif
+
+#endif /* EEPROM_FS_BACKEND_H_ */
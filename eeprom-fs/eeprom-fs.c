@@ -26,34 +26,138 @@
  to wearing over several tens of thousands of file writes.
  */
 
-#include <avr/eeprom.h>
-#include <avr/io.h>
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#endif
 #include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
 #include "eeprom-fs.h"
+#include "eeprom-fs-backend.h"
 
 #define NULL_PTR -1
 
 void* get_block_pointer(lba_t block);
+lba_t next_block_in_chain(lba_t block);
+lba_t nth_block_in_chain(lba_t block, uint16_t n);
 lba_t last_block_in_chain(lba_t block);
-lba_t write_block_data(fdata_t* data);
-void link(file_handle_t* fh);
-void unlink(lba_t block);
+lba_t nth_block_of_file(file_handle_t* fh, uint16_t n);
+void map_blocks(file_handle_t* fh, lba_t block);
+lba_t alloc_block();
+lba_t write_block_data(const fdata_t* data, size_t size);
+lba_t write_buffer(file_handle_t* fh, size_t num_bytes);
+size_t in_place_end(file_handle_t* fh);
+size_t read_blocks(file_handle_t* fh, lba_t* block, size_t position,
+		fdata_t* buf, size_t size);
+fname_t wrap_filename(fname_t filename);
+void link(file_handle_t* fh, lba_t old_block, size_t old_size);
+void unlink(lba_t first, lba_t last);
+void mark_file_blocks(uint8_t* used);
+uint16_t fsck_file(fname_t file, uint8_t* used);
+uint16_t fsck_free_space(const uint8_t* used);
 void relink(lba_t block, lba_t target);
+void read_eeprom(void* dst, const void* src, size_t n);
+void write_eeprom(const void* src, void* dst, size_t n);
+void diff_write_block(const void* src, void* dst, size_t n);
+#if EEPROM_FS_STATS || EEPROM_FS_TRACE
+uint32_t fs_ticks();
+#endif
+uint8_t meta_matches();
+void commit_alloc(fname_t index, lba_t old_block, size_t old_size);
+void load_alloc_table();
+void find_free_space();
+#if EEPROM_FS_JOURNAL_SLOTS
+void compact_journal();
+void write_sequenced(const void* src, void* dst, size_t n);
+void write_checkpoint(uint8_t copy, uint16_t seq);
+uint16_t fsck_checkpoints();
+void* checkpoint_pointer(uint8_t copy);
+void* journal_slot_pointer(uint16_t seq);
+uint8_t crc8(const void* data, size_t n);
+#elif !EEPROM_FS_FREE_BITMAP
+void scan_free_chain();
+#endif
+#if EEPROM_FS_JOURNAL_SLOTS && !EEPROM_FS_FREE_BITMAP
+void finish_unlink();
+#endif
+#if EEPROM_FS_MOUNT_SLOTS
+uint8_t load_mount_state();
+void save_mount_state();
+void invalidate_mount_state();
+void* mount_slot_pointer(uint16_t seq);
+#endif
+#if EEPROM_FS_FREE_BITMAP
+void build_free_bitmap();
+uint8_t block_is_free(lba_t block);
+void set_block_free(lba_t block, uint8_t free);
+#endif
+#if EEPROM_FS_WEAR_AWARE
+void load_block_wear();
+void* wear_pointer(lba_t block);
+#endif
+#if EEPROM_FS_BLOCK_CRC
+block_crc_t block_crc_seed(fname_t file, uint16_t index);
+block_crc_t block_crc_update(block_crc_t crc, const void* data, size_t n);
+block_crc_t stored_data_crc(lba_t block, block_crc_t crc, size_t start,
+		size_t end);
+uint8_t block_intact(lba_t block, fname_t file, uint16_t index, size_t used,
+		const fdata_t* data);
+void update_block_crc(file_handle_t* fh, size_t old_size);
+uint16_t fsck_file_data(fname_t file);
+void* crc_pointer(lba_t block, uint8_t copy);
+#endif
 
 /**
  * Debugging
+ * Messages above EEPROM_FS_DEBUG_LEVEL compile to nothing. On AVR, formats
+ * are kept in flash.
  */
+#ifdef __AVR__
+#define _FS_STR(s) PSTR(s)
+#define _FS_PRINTF printf_P
+#define _FS_FORMAT(fmt, args)
+#else
+#define _FS_STR(s) (s)
+#define _FS_PRINTF printf
+// Have the compiler check the arguments; a format in flash can't be checked
+#define _FS_FORMAT(fmt, args) __attribute__((__format__(__printf__, fmt, args)))
+#endif
+
+// Output asked for by the application, to stdout
+#define _fs_printf(format, ...) _FS_PRINTF(_FS_STR(format), ##__VA_ARGS__)
+
+#define _fs_error(format, ...) _fs_print(_FS_STR(format), ##__VA_ARGS__)
+#if EEPROM_FS_DEBUG_LEVEL >= 1
+#define _fs_debug1(format, ...) _fs_debug(1, _FS_STR(format), ##__VA_ARGS__)
+#else
+#define _fs_debug1(format, ...) do { } while (0)
+#endif
+#if EEPROM_FS_DEBUG_LEVEL >= 2
+#define _fs_debug2(format, ...) _fs_debug(2, _FS_STR(format), ##__VA_ARGS__)
+#else
+#define _fs_debug2(format, ...) do { } while (0)
+#endif
+#if EEPROM_FS_DEBUG_LEVEL >= 3
+#define _fs_debug3(format, ...) _fs_debug(3, _FS_STR(format), ##__VA_ARGS__)
+#else
+#define _fs_debug3(format, ...) do { } while (0)
+#endif
+#if EEPROM_FS_DEBUG_LEVEL >= 4
+#define _fs_debug4(format, ...) _fs_debug(4, _FS_STR(format), ##__VA_ARGS__)
+#else
+#define _fs_debug4(format, ...) do { } while (0)
+#endif
+
+void _fs_print(const char *format, ...) _FS_FORMAT(1, 2);
+#if EEPROM_FS_DEBUG_LEVEL
 uint8_t __debug = 0;
 
-void _fs_error(const char *format, ...);
-void _fs_debug1(const char *format, ...);
-void _fs_debug2(const char *format, ...);
-void _fs_debug3(const char *format, ...);
-void _fs_debug4(const char *format, ...);
+void _fs_debug(uint8_t level, const char *format, ...) _FS_FORMAT(2, 3);
+#endif
 
 /*
  * Cached allocation table
@@ -61,44 +165,193 @@ void _fs_debug4(const char *format, ...);
 file_alloc_t alloc_table[EEPROM_FS_MAX_FILES + 1];
 // Shortcut to next free block
 lba_t* const next_free_block = &alloc_table[EEPROM_FS_MAX_FILES].data_block;
+// Cached tail of the free block chain, rebuilt by init_eepromfs()
+lba_t last_free_block = NULL_PTR;
+
+#if EEPROM_FS_FREE_BITMAP
+/*
+ * Free blocks, one bit per block, rebuilt by init_eepromfs()
+ */
+uint8_t free_bitmap[(EEPROM_FS_NUM_BLOCKS + 7) / 8];
+uint16_t num_free_blocks = 0;
+// Where the search for a free block starts, so blocks are used in turn
+lba_t alloc_cursor = 0;
+#endif
+
+#if EEPROM_FS_JOURNAL_SLOTS
+/*
+ * Journal state
+ */
+// Sequence number of the last journal record written
+uint16_t journal_seq = 0;
+// Sequence number the newest checkpoint was taken at
+uint16_t checkpoint_seq = 0;
+// Which of the two checkpoint copies is the newest
+uint8_t checkpoint_copy = 0;
+#if !EEPROM_FS_FREE_BITMAP
+// Chain freed by the last journal record replayed, checked by finish_unlink()
+lba_t replayed_first = NULL_PTR;
+lba_t replayed_last = NULL_PTR;
+#endif
+#endif
+
+#if EEPROM_FS_MOUNT_SLOTS
+// Set while the mount slot for journal_seq holds the current state
+uint8_t mount_state_saved = 0;
+#endif
+
+#if EEPROM_FS_WEAR_AWARE
+/*
+ * Cached wear counts of every block
+ */
+uint16_t block_wear[EEPROM_FS_NUM_BLOCKS];
+// Allocate the most worn free blocks instead, while wear_level() moves a file
+uint8_t alloc_worn = 0;
+#endif
+
+/*
+ * Counters for the diff-aware EEPROM writer
+ */
+volatile fs_write_stats_t write_stats;
+
+#if EEPROM_FS_STATS || EEPROM_FS_TRACE
+// Clock the stats and trace time operations by, or NULL
+uint32_t (*fs_clock)(void) = NULL;
+#endif
+
+#if EEPROM_FS_STATS
+/*
+ * Counters of everything the filesystem does
+ */
+fs_stats_t fs_stats;
+// The writer's counters when fs_stats was reset. Bytes written and skipped
+// are counted from these, so bytes a queued write programs later are still
+// counted.
+fs_write_stats_t fs_stats_base;
+
+#define _fs_count(counter, n) (fs_stats.counter += (n))
+#else
+#define _fs_count(counter, n) do { } while (0)
+#endif
+
+#if EEPROM_FS_TRACE
+/*
+ * Ring of the most recent operations
+ */
+fs_trace_entry_t trace_ring[EEPROM_FS_TRACE];
+// Where the next entry goes, and how many entries the ring holds
+uint16_t trace_next = 0;
+uint16_t trace_len = 0;
+// Number of traced operations under way
+uint8_t trace_depth = 0;
+
+/*
+ * Operation being traced
+ */
+typedef struct trace_span
+{
+	uint32_t start;
+	fs_trace_entry_t entry;
+} trace_span_t;
+
+trace_span_t trace_begin(fs_trace_op_t op, fname_t file, lba_t block);
+void trace_end(trace_span_t* span);
+
+// Trace the enclosing function from here until it returns, whichever way
+#define _fs_trace(op, file, block) \
+	trace_span_t _trace __attribute__((cleanup(trace_end))) \
+			= trace_begin(op, file, block)
+// Set the block the traced operation ended up on
+#define _fs_trace_block(block) (_trace.entry.block = (block))
+#else
+#define _fs_trace(op, file, block) do { } while (0)
+#define _fs_trace_block(block) do { } while (0)
+#endif
+
+/*
+ * Storage backend
+ */
+#ifdef __AVR__
+const fs_backend_t* backend = &avr_eeprom_backend;
+#else
+const fs_backend_t* backend = &ram_backend;
+#endif
 
 /**
  * Initialise the file system
  */
 void init_eepromfs()
 {
+	_fs_trace(TRACE_INIT, TRACE_NO_FILE, NULL_PTR);
 	_fs_debug1("Initialising filesystem.\n");
 
-	// Retrieve metadata
-	_fs_debug2("Loading metadata...");
-	fs_meta_t stored_meta;
-	eeprom_read_block((void*) &stored_meta,
-			(void*) (EEPROM_FS_START + EEPROM_FS_META_OFFSET),
-			sizeof(fs_meta_t));
-	_fs_debug2("Done.\n");
+#if EEPROM_FS_WEAR_AWARE
+	alloc_worn = 0;
+#endif
 
 	// Format if metadata has changed
-	if (stored_meta.block_size != EEPROM_FS_BLOCK_SIZE
-			|| stored_meta.start_address != EEPROM_FS_START
-			|| stored_meta.fs_size != EEPROM_FS_SIZE
-			|| stored_meta.max_files != EEPROM_FS_MAX_FILES
-			|| stored_meta.max_blocks_per_file != EEPROM_FS_MAX_BLOCKS_PER_FILE)
+	if (!meta_matches())
 	{
 		format_eepromfs(FORMAT_QUICK);
 	}
+#if EEPROM_FS_WEAR_AWARE
+	else
+	{
+		load_block_wear();
+	}
+#endif
 
 	// Load allocation table
 	_fs_debug2("Loading file allocation table...");
-	eeprom_read_block(alloc_table,
-			(void*) (EEPROM_FS_START + EEPROM_FS_ALLOC_TABLE_OFFSET),
-			sizeof(alloc_table));
+	load_alloc_table();
 	_fs_debug2("Done.\n");
 
 	_fs_debug3("Next free block: %d\n", *next_free_block);
 
+#if EEPROM_FS_MOUNT_SLOTS
+	// After a clean unmount, the free space state was saved
+	if (!load_mount_state())
+#endif
+	{
+		find_free_space();
+	}
+
+#if EEPROM_FS_JOURNAL_SLOTS
+#if !EEPROM_FS_FREE_BITMAP
+	finish_unlink();
+#endif
+	compact_journal();
+#endif
+
+#if EEPROM_FS_MOUNT_FSCK
+	fsck_eepromfs(FSCK_QUICK);
+#endif
+
+#if EEPROM_FS_FREE_BITMAP
+	_fs_debug3("Free blocks: %d\n", num_free_blocks);
+#else
+	_fs_debug3("Last free block: %d\n", last_free_block);
+#endif
+
 	_fs_debug1("Filesystem initialised.\n");
 }
 
+/**
+ * Finish using the file system
+ */
+void unmount_eepromfs()
+{
+	_fs_trace(TRACE_UNMOUNT, TRACE_NO_FILE, NULL_PTR);
+	_fs_debug1("Unmounting filesystem.\n");
+
+#if EEPROM_FS_MOUNT_SLOTS
+	save_mount_state();
+#endif
+	flush_eepromfs();
+
+	_fs_debug1("Filesystem unmounted.\n");
+}
+
 /**
  * Perform a format of the EEPROM
  *
@@ -110,8 +363,28 @@ void init_eepromfs()
  */
 void format_eepromfs(format_type_t f)
 {
+	_fs_trace(TRACE_FORMAT, TRACE_NO_FILE, NULL_PTR);
 	_fs_debug1("Formatting filesystem.\n");
 
+#if EEPROM_FS_WEAR_AWARE
+	// Wear counts outlive a format, unless the layout has changed
+	if (meta_matches())
+	{
+		load_block_wear();
+	}
+	else
+	{
+		memset(block_wear, 0, sizeof(block_wear));
+	}
+#endif
+
+	// The metadata is written again once the format is done, so a format cut
+	// short by a power failure is started again by the next init_eepromfs()
+	uint16_t unformatted;
+	memset(&unformatted, backend->erased_value, sizeof(uint16_t));
+	diff_write_block((void*) &unformatted,
+			(void*) (EEPROM_FS_START + EEPROM_FS_META_OFFSET), sizeof(uint16_t));
+
 	if (f == FORMAT_WIPE)
 	{
 		wipe_eeprom();
@@ -133,12 +406,21 @@ void format_eepromfs(format_type_t f)
 	for (lba_t i = 0; i < EEPROM_FS_NUM_BLOCKS; i++)
 	{
 		block.next_block = i - 1;
+#if EEPROM_FS_WEAR_AWARE
+		block.wear = block_wear[i];
+		if (f != FORMAT_FULL)
+		{
+			diff_write_block((void*) &block_wear[i], wear_pointer(i),
+					sizeof(uint16_t));
+		}
+#endif
+
 		if (f == FORMAT_FULL)
 		{
 			// Overwrite entire block, clearing data
 			_fs_debug3("Relinking block %d -> %d...", i, block.next_block);
 
-			eeprom_update_block((void*) &block, get_block_pointer(i),
+			diff_write_block((void*) &block, get_block_pointer(i),
 			EEPROM_FS_BLOCK_SIZE);
 
 			_fs_debug3("Done.\n");
@@ -170,9 +452,40 @@ void format_eepromfs(format_type_t f)
 	free.filesize = 0;
 	alloc_table[EEPROM_FS_MAX_FILES] = free;
 
-	eeprom_update_block((void*) alloc_table,
+	// Blocks are chained in descending order, so block 0 ends the chain
+	last_free_block = 0;
+
+#if EEPROM_FS_JOURNAL_SLOTS
+	// Start a new journal from matching checkpoints in both copies
+	write_checkpoint(0, 0);
+	write_checkpoint(1, 0);
+	checkpoint_copy = 0;
+	checkpoint_seq = 0;
+	journal_seq = 0;
+
+	// Leave no records behind that could be replayed into the new table
+	fs_journal_record_t erased;
+	memset(&erased, backend->erased_value, sizeof(fs_journal_record_t));
+	for (uint16_t i = 0; i < EEPROM_FS_JOURNAL_SLOTS; i++)
+	{
+		diff_write_block((void*) &erased, journal_slot_pointer(i),
+				sizeof(fs_journal_record_t));
+	}
+#if EEPROM_FS_MOUNT_SLOTS
+	fs_mount_state_t erased_state;
+	memset(&erased_state, backend->erased_value, sizeof(fs_mount_state_t));
+	for (uint16_t i = 0; i < EEPROM_FS_MOUNT_SLOTS; i++)
+	{
+		diff_write_block((void*) &erased_state, mount_slot_pointer(i),
+				sizeof(fs_mount_state_t));
+	}
+	mount_state_saved = 0;
+#endif
+#else
+	diff_write_block((void*) alloc_table,
 			(void*) (EEPROM_FS_START + EEPROM_FS_ALLOC_TABLE_OFFSET),
 			sizeof(alloc_table));
+#endif
 
 	_fs_debug2("Done.\n");
 
@@ -184,11 +497,20 @@ void format_eepromfs(format_type_t f)
 	this_meta.fs_size = EEPROM_FS_SIZE;
 	this_meta.max_files = EEPROM_FS_MAX_FILES;
 	this_meta.max_blocks_per_file = EEPROM_FS_MAX_BLOCKS_PER_FILE;
-	eeprom_write_block((void*) &this_meta,
+	this_meta.journal_slots = EEPROM_FS_JOURNAL_SLOTS;
+	this_meta.block_data_size = EEPROM_FS_BLOCK_DATA_SIZE;
+	this_meta.free_bitmap = EEPROM_FS_FREE_BITMAP;
+	this_meta.mount_slots = EEPROM_FS_MOUNT_SLOTS;
+	this_meta.block_crc = EEPROM_FS_BLOCK_CRC;
+	diff_write_block((void*) &this_meta,
 			(void*) (EEPROM_FS_START + EEPROM_FS_META_OFFSET),
 			sizeof(fs_meta_t));
 	_fs_debug2("Done.\n");
 
+#if EEPROM_FS_FREE_BITMAP
+	build_free_bitmap();
+#endif
+
 	_fs_debug1("Successfully formatted.\n");
 }
 
@@ -196,12 +518,9 @@ file_handle_t open_for_write(fname_t filename)
 {
 	_fs_debug1("Preparing file %d for writing.\n", filename);
 
-	// Wrap filename around in case it's larger than maximum supported
-	if (filename > EEPROM_FS_MAX_FILES)
-	{
-		filename = filename % EEPROM_FS_MAX_FILES;
-		_fs_debug2("Filename too large - truncated to %d.\n", filename);
-	}
+	filename = wrap_filename(filename);
+
+	_fs_trace(TRACE_OPEN_WRITE, filename, alloc_table[filename].data_block);
 
 	file_handle_t fh;
 	fh.filename = filename;
@@ -209,6 +528,12 @@ file_handle_t open_for_write(fname_t filename)
 	fh.type = FH_WRITE;
 	fh.first_block = NULL_PTR;
 	fh.last_block = NULL_PTR;
+	fh.position = 0;
+	fh.position_block = NULL_PTR;
+#if EEPROM_FS_BLOCK_CRC
+	fh.checked_block = NULL_PTR;
+#endif
+	map_blocks(&fh, NULL_PTR);
 
 	_fs_debug1("File ready.\n");
 
@@ -219,12 +544,9 @@ file_handle_t open_for_append(fname_t filename)
 {
 	_fs_debug1("Preparing file %d for appending.\n", filename);
 
-	// Wrap filename around in case it's larger than maximum supported
-	if (filename > EEPROM_FS_MAX_FILES)
-	{
-		filename = filename % EEPROM_FS_MAX_FILES;
-		_fs_debug2("Filename too large - truncated to %d.\n", filename);
-	}
+	filename = wrap_filename(filename);
+
+	_fs_trace(TRACE_OPEN_APPEND, filename, alloc_table[filename].data_block);
 
 	file_handle_t fh;
 	fh.filename = filename;
@@ -232,6 +554,19 @@ file_handle_t open_for_append(fname_t filename)
 	fh.type = FH_APPEND;
 	fh.first_block = NULL_PTR;
 	fh.last_block = NULL_PTR;
+	fh.position = 0;
+	fh.position_block = NULL_PTR;
+#if EEPROM_FS_BLOCK_CRC
+	fh.checked_block = NULL_PTR;
+#endif
+	map_blocks(&fh, alloc_table[filename].data_block);
+
+	if (fh.filesize > 0)
+	{
+		// New data fills the rest of the last block in place
+		fh.last_block = nth_block_of_file(&fh,
+				(fh.filesize - 1) / EEPROM_FS_BLOCK_DATA_SIZE);
+	}
 
 	_fs_debug1("File ready.\n");
 
@@ -242,12 +577,9 @@ file_handle_t open_for_read(fname_t filename)
 {
 	_fs_debug1("Preparing file %d for reading.\n", filename);
 
-	// Wrap filename around in case it's larger than maximum supported
-	if (filename > EEPROM_FS_MAX_FILES)
-	{
-		filename = filename % EEPROM_FS_MAX_FILES;
-		_fs_debug2("Filename too large - truncated to %d.\n", filename);
-	}
+	filename = wrap_filename(filename);
+
+	_fs_trace(TRACE_OPEN_READ, filename, alloc_table[filename].data_block);
 
 	file_handle_t fh;
 	fh.filename = filename;
@@ -255,6 +587,12 @@ file_handle_t open_for_read(fname_t filename)
 	fh.type = FH_READ;
 	fh.first_block = alloc_table[filename].data_block;
 	fh.last_block = NULL_PTR;
+	fh.position = 0;
+	fh.position_block = fh.first_block;
+#if EEPROM_FS_BLOCK_CRC
+	fh.checked_block = NULL_PTR;
+#endif
+	map_blocks(&fh, fh.first_block);
 
 	if (fh.first_block == NULL_PTR)
 	{
@@ -269,56 +607,91 @@ file_handle_t open_for_read(fname_t filename)
 }
 
 /**
- * Link a written file to the allocation table and unlink any free space used.
+ * Link a written file to the allocation table and free the blocks it replaced.
  *
- * File is linked to the allocation table before unlinking free space so if the
- * system fails before the free space is unlinked, there will be no orphaned blocks.
+ * Every block of the file is written before its allocation table entry is
+ * committed, and the blocks it replaced are only freed after, so if the
+ * system fails part way through, the file is left either as it was or as
+ * written. The end of a file isn't marked in its chain: the chain is only
+ * followed as far as the file's size.
  *
  * \param fh File handle
  */
 void close(file_handle_t* fh)
 {
+	_fs_trace(TRACE_CLOSE, fh->filename, fh->first_block);
+	_fs_count(closes, 1);
+
+	if (fh->type == FH_READ)
+	{
+		// Nothing to commit
+		return;
+	}
+
 	_fs_debug1("Finalising file %d.\n", fh->filename);
 
-	if (fh->type == FH_APPEND)
+	file_alloc_t old = alloc_table[fh->filename];
+
+	if (fh->type == FH_APPEND && fh->filesize == old.filesize)
+	{
+		_fs_debug1("Nothing appended to file %d.\n", fh->filename);
+		return;
+	}
+
+	// Write out the last, partially filled block
+	size_t num_bytes = fh->filesize % EEPROM_FS_BLOCK_DATA_SIZE;
+	if (num_bytes > 0 && fh->filesize > in_place_end(fh))
 	{
-		// Sum the filesize of the existing file
-		fh->filesize += alloc_table[fh->filename].filesize;
+		write_buffer(fh, num_bytes);
+	}
+
+	if (fh->type == FH_APPEND && old.data_block != NULL_PTR && old.filesize > 0)
+	{
+		lba_t first_new = fh->first_block;
+
+#if EEPROM_FS_BLOCK_CRC
+		if (old.filesize % EEPROM_FS_BLOCK_DATA_SIZE > 0)
+		{
+			// Data was appended in place to the old last block
+			update_block_crc(fh, old.filesize);
+		}
+#endif
 
-		if (alloc_table[fh->filename].filesize > EEPROM_FS_BLOCK_DATA_SIZE)
+		if (first_new != NULL_PTR)
 		{
-			// If the first block hasn't been rewritten, link the appended data to the last block
-			lba_t last = last_block_in_chain(
-					alloc_table[fh->filename].data_block);
+			lba_t last = nth_block_of_file(fh,
+					(old.filesize - 1) / EEPROM_FS_BLOCK_DATA_SIZE);
 
-			_fs_debug2("Appending block %d to block %d...\n", fh->first_block,
-					last);
+			_fs_debug2("Appending block %d to block %d...\n", first_new, last);
 
-			// Point the last block of the current file to the first block in the new chain
-			relink(last, fh->first_block);
+			// Point the last block of the current file to the first block in
+			// the new chain. Until the new size is committed, the file is
+			// still only read as far as this block.
+			relink(last, first_new);
 
 			_fs_debug2("Done.\n");
 		}
-		else
+
+		// The file still starts at its original first block
+		fh->first_block = old.data_block;
+		link(fh, NULL_PTR, 0);
+	}
+	else if (fh->first_block == NULL_PTR)
+	{
+		if (fh->type == FH_WRITE && fh->filesize == 0
+				&& old.data_block != NULL_PTR)
 		{
-			// Otherwise, just link the file to the new stuff and discard the old block
-			if (alloc_table[fh->filename].filesize > 0)
-			{
-				unlink(alloc_table[fh->filename].data_block);
-			}
-			link(fh);
+			// An empty file takes no space at all
+			delete(fh->filename);
 		}
+		return;
 	}
 	else
 	{
-		link(fh);
+		// Free the chain that the new one replaced, once it is committed
+		link(fh, old.data_block, old.filesize);
 	}
 
-	_fs_debug2("Marking end of file %d.\n", fh->filename);
-
-	// Mark end of file
-	relink(fh->last_block, NULL_PTR);
-
 	_fs_debug1("File %d successfully finalised.\n", fh->filename);
 }
 
@@ -327,103 +700,85 @@ void close(file_handle_t* fh)
  *
  * \param fh File handle opened for writing or appending
  * \param data Data to write.
- * \param size Amount of data to write (becomes filesize)
+ * \param size Amount of data to write
  */
 void write(file_handle_t* fh, const fdata_t* data, size_t size)
 {
-	if (fh->type == FH_WRITE || fh->type == FH_APPEND)
-	{
-		/*
-		 * Handle non-complete blocks for appending
-		 */
-		if (fh->type == FH_APPEND
-				&& fh->filesize % EEPROM_FS_BLOCK_DATA_SIZE > 0)
-		{
-			// Last block of current file is incomplete. Prepend it to the new data.
-			size_t overflow = fh->filesize % EEPROM_FS_BLOCK_DATA_SIZE;
-			fdata_t* to_write[overflow + size];
-
-			// Read from last block
-			file_handle_t last_block_fh = *fh;
-			last_block_fh.first_block = last_block_in_chain(
-					alloc_table[fh->filename].data_block);
-			last_block_fh.filesize = overflow;
-			read(&last_block_fh, (fdata_t*) to_write);
-
-			// Copy new data in to new array
-			uintptr_t offset = (uintptr_t) to_write
-					+ (uintptr_t) (overflow * sizeof(fdata_t));
-			memcpy((void*) offset, data, size * sizeof(fdata_t));
-
-			// Update existing variables
-			data = (const fdata_t*) to_write;
-			size = overflow + size;
-		}
+	write_chunk(fh, data, size);
+}
 
-		_fs_debug1("Writing %d bytes to file %d.\n", size, fh->filename);
+/**
+ * Write the next chunk of a file.
+ * Data is copied into the file handle's block buffer, which is written out
+ * to the next free block each time it fills.
+ *
+ * \param fh File handle opened for writing or appending
+ * \param data Data to write.
+ * \param size Amount of data to write (added to filesize)
+ */
+void write_chunk(file_handle_t* fh, const fdata_t* data, size_t size)
+{
+	_fs_trace(TRACE_WRITE, fh->filename, fh->last_block);
+	_fs_count(writes, 1);
 
-		size_t num_blocks;
+	if (fh->type == FH_WRITE || fh->type == FH_APPEND)
+	{
+		_fs_debug1("Writing %u bytes to file %d.\n", (unsigned int) size,
+				fh->filename);
 
 		// Don't allow any files bigger than max blocks
-		size_t blocks_in_use = alloc_table[fh->filename].filesize
-				/ EEPROM_FS_BLOCK_DATA_SIZE;
-		if (blocks_in_use + size / EEPROM_FS_BLOCK_DATA_SIZE
-				> EEPROM_FS_MAX_BLOCKS_PER_FILE)
-		{
-			num_blocks = EEPROM_FS_MAX_BLOCKS_PER_FILE - blocks_in_use;
-			_fs_error("File too large - write truncated to %d bytes.\n",
-					num_blocks * EEPROM_FS_BLOCK_DATA_SIZE);
-		}
-		else
+		size_t max_size = EEPROM_FS_MAX_BLOCKS_PER_FILE
+				* EEPROM_FS_BLOCK_DATA_SIZE;
+		if (fh->filesize + size > max_size)
 		{
-			num_blocks = (size / EEPROM_FS_BLOCK_DATA_SIZE) + 1;
+			size = fh->filesize < max_size ? max_size - fh->filesize : 0;
+			_fs_error("File too large - write truncated to %u bytes.\n",
+					(unsigned int) size);
 		}
 
-		if (num_blocks > 0)
+		while (size > 0)
 		{
-			/*
-			 * Split data into blocks
-			 */
-			block_t block;
-			size_t num_bytes = EEPROM_FS_BLOCK_DATA_SIZE;
-
-			fh->first_block = *next_free_block;
-			for (uint16_t i = 0; i < num_blocks; i++)
+			// Fill the rest of the current block
+			size_t offset = fh->filesize % EEPROM_FS_BLOCK_DATA_SIZE;
+			size_t num_bytes = EEPROM_FS_BLOCK_DATA_SIZE - offset;
+			if (num_bytes > size)
 			{
-				// Don't write more than file's size
-				if ((i + 1) * EEPROM_FS_BLOCK_DATA_SIZE > size)
-				{
-					num_bytes = size % EEPROM_FS_BLOCK_DATA_SIZE;
-				}
-
-				// Copy data for this block
-				for (uint16_t j = 0; j < num_bytes; j++)
-				{
-					block.data[j] = data[i * EEPROM_FS_BLOCK_DATA_SIZE + j];
-					_fs_debug4("data[%d] = %c\n", i * EEPROM_FS_BLOCK_DATA_SIZE + j,
-							block.data[j]);
-				}
-
-				// Update file handle data
-				fh->last_block = write_block_data(block.data);
+				num_bytes = size;
 			}
 
-			// In case the data was truncated, recalculate size
-			if (size > num_blocks * EEPROM_FS_BLOCK_DATA_SIZE)
+			if (fh->filesize < in_place_end(fh))
 			{
-				fh->filesize = num_blocks * EEPROM_FS_BLOCK_DATA_SIZE;
+				// Write straight into the unused end of the existing last block
+				_fs_debug2("Appending %u bytes to block %d...",
+						(unsigned int) num_bytes, fh->last_block);
+				void* addr = get_block_pointer(fh->last_block)
+						+ (EEPROM_FS_BLOCK_SIZE - EEPROM_FS_BLOCK_DATA_SIZE)
+						+ offset;
+				diff_write_block((const void*) data, addr, num_bytes);
+				_fs_debug2("Done.\n");
+
+				fh->filesize += num_bytes;
+				data += num_bytes;
+				size -= num_bytes;
+				continue;
 			}
-			else
+
+			memcpy(&fh->buffer[offset], data, num_bytes * sizeof(fdata_t));
+			fh->filesize += num_bytes;
+			data += num_bytes;
+			size -= num_bytes;
+
+			// Write the block out as soon as it is full
+			if (offset + num_bytes == EEPROM_FS_BLOCK_DATA_SIZE
+					&& write_buffer(fh, EEPROM_FS_BLOCK_DATA_SIZE) == NULL_PTR)
 			{
-				fh->filesize = size;
+				_fs_error("No more space available for file %d.\n",
+						fh->filename);
+				return;
 			}
-
-			_fs_debug1("File %d successfully written.\n", fh->filename);
-		}
-		else
-		{
-			_fs_error("No more space available for file %d.\n", fh->filename);
 		}
+
+		_fs_debug1("File %d successfully written.\n", fh->filename);
 	}
 	else
 	{
@@ -440,41 +795,102 @@ void write(file_handle_t* fh, const fdata_t* data, size_t size)
  */
 void read(file_handle_t* fh, fdata_t* buf)
 {
+	pread(fh, 0, buf, fh->filesize);
+}
+
+/**
+ * Read part of a file into a buffer.
+ * Whole blocks before the offset are skipped by following their links only.
+ *
+ * \param fh File handle opened for reading
+ * \param offset Position in the file to start reading from
+ * \param buf Buffer to copy file contents to
+ * \param size Maximum amount of data to read
+ * \return Amount of data read
+ */
+size_t pread(file_handle_t* fh, size_t offset, fdata_t* buf, size_t size)
+{
+	_fs_trace(TRACE_READ, fh->filename, NULL_PTR);
+	_fs_count(reads, 1);
+
 	if (fh->first_block >= 0 && fh->first_block < (lba_t) EEPROM_FS_NUM_BLOCKS)
 	{
-		block_t block;
-		block.next_block = fh->first_block;
+		// Don't read more than file's size
+		if (offset >= fh->filesize)
+		{
+			return 0;
+		}
+		if (size > fh->filesize - offset)
+		{
+			size = fh->filesize - offset;
+		}
+
+		lba_t block = nth_block_of_file(fh, offset / EEPROM_FS_BLOCK_DATA_SIZE);
+		_fs_trace_block(block);
+		return read_blocks(fh, &block, offset, buf, size);
+	}
+	else
+	{
+		_fs_error("Tried to read from null file handle.\n");
+		return 0;
+	}
+}
 
-		uint16_t i = 0;
-		size_t num_bytes = EEPROM_FS_BLOCK_DATA_SIZE;
-		do
+/**
+ * Read the next part of a file into a buffer, starting from the read cursor.
+ *
+ * \param fh File handle opened for reading
+ * \param buf Buffer to copy file contents to
+ * \param size Maximum amount of data to read
+ * \return Amount of data read
+ */
+size_t read_chunk(file_handle_t* fh, fdata_t* buf, size_t size)
+{
+	_fs_trace(TRACE_READ, fh->filename, fh->position_block);
+	_fs_count(reads, 1);
+
+	if (fh->first_block >= 0 && fh->first_block < (lba_t) EEPROM_FS_NUM_BLOCKS)
+	{
+		// Don't read more than file's size
+		if (fh->position >= fh->filesize)
+		{
+			return 0;
+		}
+		if (size > fh->filesize - fh->position)
 		{
-			_fs_debug3("Reading from block %d...", block.next_block);
-			eeprom_read_block((void*) &block,
-					get_block_pointer(block.next_block),
-					EEPROM_FS_BLOCK_SIZE);
-			_fs_debug3("Done.\n", block.next_block);
+			size = fh->filesize - fh->position;
+		}
 
-			// Don't read more than file's size
-			if ((i + 1) * EEPROM_FS_BLOCK_DATA_SIZE > fh->filesize)
-			{
-				num_bytes = fh->filesize % EEPROM_FS_BLOCK_DATA_SIZE;
-			}
+		size = read_blocks(fh, &fh->position_block, fh->position, buf, size);
+		fh->position += size;
 
-			// Copy this block's data to the buffer
-			for (uint16_t j = 0; j < num_bytes; j++)
-			{
-				_fs_debug4("buf[%d] = %c\n", i * EEPROM_FS_BLOCK_DATA_SIZE + j,
-						block.data[j]);
-				buf[i * EEPROM_FS_BLOCK_DATA_SIZE + j] = block.data[j];
-			}
-			i++;
-		} while (block.next_block != NULL_PTR);
+		return size;
 	}
 	else
 	{
 		_fs_error("Tried to read from null file handle.\n");
+		return 0;
+	}
+}
+
+/**
+ * Move the read cursor of a file handle
+ *
+ * \param fh File handle opened for reading
+ * \param offset Position in the file to move to. Limited to the filesize.
+ */
+void seek(file_handle_t* fh, size_t offset)
+{
+	_fs_trace(TRACE_SEEK, fh->filename, fh->position_block);
+
+	if (offset > fh->filesize)
+	{
+		offset = fh->filesize;
 	}
+
+	fh->position = offset;
+	fh->position_block = nth_block_of_file(fh,
+			offset / EEPROM_FS_BLOCK_DATA_SIZE);
 }
 
 /**
@@ -482,223 +898,2121 @@ void read(file_handle_t* fh, fdata_t* buf)
  */
 void delete(fname_t filename)
 {
+	_fs_count(deletes, 1);
+
 	_fs_debug1("Deleting file %d.\n", filename);
 
-	// Wrap filename around in case it's larger than maximum supported
-	if (filename > EEPROM_FS_MAX_FILES)
+	filename = wrap_filename(filename);
+
+	file_alloc_t old = alloc_table[filename];
+	_fs_trace(TRACE_DELETE, filename, old.data_block);
+	if (old.data_block == NULL_PTR)
 	{
-		filename = filename % EEPROM_FS_MAX_FILES;
-		_fs_debug2("Filename too large - truncated to %d.\n", filename);
+		_fs_error("File %d not found.\n", filename);
+		return;
 	}
 
-	// Wrap filename around in case it's larger than maximum supported
-	filename = filename % EEPROM_FS_MAX_FILES;
-
-	// Unlink data
-	unlink(alloc_table[filename].data_block);
-	// Delete from allocation table
-
+	// Delete from allocation table, then unlink data
 	alloc_table[filename].filesize = 0;
 	alloc_table[filename].data_block = NULL_PTR;
-
-	void* alloc_offset = (void*) (EEPROM_FS_START + EEPROM_FS_ALLOC_TABLE_OFFSET
-			+ filename * sizeof(file_alloc_t));
-	eeprom_update_block((void*) &alloc_table[filename], alloc_offset,
-			sizeof(file_alloc_t));
+	commit_alloc(filename, old.data_block, old.filesize);
 
 	_fs_debug1("File %d successfully deleted.\n", filename);
 }
 
 /**
- * Returns the EEPROM pointer to the logical block
- *
- * \param block Logical block to look up
+ * Returns the number of bytes of free space
  */
-void* get_block_pointer(lba_t block)
+size_t free_space()
 {
-	return (void*) (EEPROM_FS_START + EEPROM_FS_DATA_OFFSET
-			+ ((block * EEPROM_FS_BLOCK_SIZE) % EEPROM_FS_SIZE));
+	_fs_trace(TRACE_FREE_SPACE, TRACE_NO_FILE, NULL_PTR);
+
+#if EEPROM_FS_FREE_BITMAP
+	return (size_t) num_free_blocks * EEPROM_FS_BLOCK_DATA_SIZE;
+#else
+	uint16_t num_free = 0;
+	lba_t block = *next_free_block;
+	while (block >= 0 && block < (lba_t) EEPROM_FS_NUM_BLOCKS
+			&& num_free < EEPROM_FS_NUM_BLOCKS)
+	{
+		num_free++;
+		if (block == last_free_block)
+		{
+			break;
+		}
+		block = next_block_in_chain(block);
+	}
+	return (size_t) num_free * EEPROM_FS_BLOCK_DATA_SIZE;
+#endif
 }
 
 /**
- * Returns the last logical block of a block chain
+ * Check the filesystem for damage, and repair it
  *
- * \param block Any block in the block chain to look up
- * \return Address of last block in the block chain, or NULL for failure
+ * \param f FSCK_QUICK checks every file's block chain against its size, and
+ *          	the free space against the blocks no file holds, reading each
+ *          	block header at most once.
+ *          FSCK_FULL also checks both copies of the allocation table
+ *          	checkpoint, and writes the table over a damaged copy.
+ *          	With EEPROM_FS_BLOCK_CRC, it also checks the data of every
+ *          	file against its CRCs, and reports corrupt blocks.
+ * \return Number of problems found
  */
-lba_t last_block_in_chain(lba_t block)
+uint16_t fsck_eepromfs(fsck_type_t f)
 {
-	if (block >= 0 && block < (lba_t) EEPROM_FS_NUM_BLOCKS)
-	{
-		_fs_debug3("Searching for last block in chain...\n");
+	_fs_trace(TRACE_FSCK, TRACE_NO_FILE, NULL_PTR);
+	_fs_debug1("Checking filesystem.\n");
 
-		block_t current_block;
-		current_block.next_block = block;
-		do
-		{
-			block = current_block.next_block;
-			_fs_debug4("checking... %d\n", block);
-			eeprom_read_block((void*) &current_block, get_block_pointer(block),
-			EEPROM_FS_BLOCK_SIZE);
-		} while (current_block.next_block != NULL_PTR);
+	// Blocks held by files, filled in as each file is checked
+	uint8_t used[(EEPROM_FS_NUM_BLOCKS + 7) / 8];
+	memset(used, 0, sizeof(used));
 
-		_fs_debug3("Last block in chain: %d\n", block);
+	uint16_t problems = 0;
+	for (fname_t i = 0; i < EEPROM_FS_MAX_FILES; i++)
+	{
+		problems += fsck_file(i, used);
+	}
+	problems += fsck_free_space(used);
 
-		return block;
+#if EEPROM_FS_BLOCK_CRC
+	if (f == FSCK_FULL)
+	{
+		for (fname_t i = 0; i < EEPROM_FS_MAX_FILES; i++)
+		{
+			problems += fsck_file_data(i);
+		}
 	}
-	else
+#endif
+
+#if EEPROM_FS_JOURNAL_SLOTS
+	if (f == FSCK_FULL)
 	{
-		_fs_error("Block %d is not part of a block chain.\n", block);
-		return NULL_PTR;
+		problems += fsck_checkpoints();
 	}
+#endif
+
+	_fs_debug1("Filesystem checked: %d problems.\n", problems);
+	return problems;
 }
 
+#if EEPROM_FS_WEAR_AWARE
 /**
- * Writes a block of data to the next free address
- * Advances the cached next_free_block
+ * Move the file on the least worn blocks onto the most worn free blocks,
+ * if the most worn free block has been written
+ * EEPROM_FS_STATIC_WEAR_THRESHOLD times more.
+ * Files that are never rewritten would otherwise keep their blocks fresh
+ * forever, while every other file wears out the rest.
  *
- * \param data Block data to write
- * \return Address of block written, or NULL if failure
+ * The file is moved by rewriting it, so it's committed through the
+ * allocation table like any other write, and its old blocks are freed.
+ *
+ * \return 1 if a file was moved, 0 if not
  */
-lba_t write_block_data(fdata_t* data)
+uint8_t wear_level()
 {
-	lba_t write_to = *next_free_block;
+	_fs_trace(TRACE_WEAR_LEVEL, TRACE_NO_FILE, NULL_PTR);
 
-	if (write_to >= 0 && write_to < (lba_t) EEPROM_FS_NUM_BLOCKS)
+	// Find the least worn block in a file
+	uint16_t cold_wear = UINT16_MAX;
+	fname_t cold_file = 0;
+	uint16_t cold_blocks = 0;
+	for (fname_t i = 0; i < EEPROM_FS_MAX_FILES; i++)
 	{
-		block_t current_block_data;
-		eeprom_read_block((void*) &current_block_data,
-				get_block_pointer(write_to),
-				EEPROM_FS_BLOCK_SIZE);
+		uint16_t num_blocks = (alloc_table[i].filesize
+				+ EEPROM_FS_BLOCK_DATA_SIZE - 1) / EEPROM_FS_BLOCK_DATA_SIZE;
+		lba_t block = alloc_table[i].data_block;
 
-		// Update next free block
-		*next_free_block = current_block_data.next_block;
+		for (uint16_t n = 0; n < num_blocks && block >= 0
+				&& block < (lba_t) EEPROM_FS_NUM_BLOCKS; n++)
+		{
+			if (block_wear[block] < cold_wear)
+			{
+				cold_wear = block_wear[block];
+				cold_file = i;
+				cold_blocks = num_blocks;
+			}
+			block = next_block_in_chain(block);
+		}
+	}
 
-		_fs_debug2("Overwriting block %d...", write_to);
+	// Find the most worn free block
+	uint16_t hot_wear = 0;
+	uint16_t num_free = 0;
+#if EEPROM_FS_FREE_BITMAP
+	for (lba_t i = 0; i < (lba_t) EEPROM_FS_NUM_BLOCKS; i++)
+	{
+		if (block_is_free(i))
+		{
+			num_free++;
+			if (block_wear[i] > hot_wear)
+			{
+				hot_wear = block_wear[i];
+			}
+		}
+	}
+#else
+	lba_t block = *next_free_block;
+	while (block >= 0 && block < (lba_t) EEPROM_FS_NUM_BLOCKS
+			&& num_free < EEPROM_FS_NUM_BLOCKS)
+	{
+		num_free++;
+		if (block_wear[block] > hot_wear)
+		{
+			hot_wear = block_wear[block];
+		}
+		if (block == last_free_block)
+		{
+			break;
+		}
+		block = next_block_in_chain(block);
+	}
+#endif
 
-		// Write data only
-		void* addr = get_block_pointer(write_to)
-				+ (EEPROM_FS_BLOCK_SIZE - EEPROM_FS_BLOCK_DATA_SIZE);
-		eeprom_write_block(data, addr, EEPROM_FS_BLOCK_DATA_SIZE);
+	if (cold_wear == UINT16_MAX
+			|| hot_wear <= cold_wear + EEPROM_FS_STATIC_WEAR_THRESHOLD)
+	{
+		return 0;
+	}
+	if (num_free < cold_blocks)
+	{
+		_fs_debug2("Not enough free blocks to move file %d.\n", cold_file);
+		return 0;
+	}
 
-		_fs_debug2("Done.\n");
+	_fs_debug1("Moving file %d off blocks worn %u times.\n", cold_file,
+			cold_wear);
 
-		_fs_debug3("Next free block: %d\n", *next_free_block);
+	file_handle_t src = open_for_read(cold_file);
+	file_handle_t dst = open_for_write(cold_file);
+	fdata_t buf[EEPROM_FS_BLOCK_DATA_SIZE];
+	size_t num_bytes;
 
-		return write_to;
-	}
-	else
+	alloc_worn = 1;
+	while ((num_bytes = read_chunk(&src, buf, EEPROM_FS_BLOCK_DATA_SIZE)) > 0)
 	{
-		_fs_error("Attempted to write to invalid block %d.\n", write_to);
-		return NULL_PTR;
+		write_chunk(&dst, buf, num_bytes);
 	}
+	alloc_worn = 0;
+
+	if (dst.filesize != src.filesize)
+	{
+		// Don't commit a truncated copy, and give back the blocks it took
+		_fs_error("Failed to move file %d.\n", cold_file);
+		if (dst.first_block != NULL_PTR)
+		{
+			unlink(dst.first_block, dst.last_block);
+		}
+		return 0;
+	}
+	close(&dst);
+
+	return 1;
+}
+#endif
+
+/**
+ * Returns the EEPROM pointer to the logical block
+ *
+ * \param block Logical block to look up
+ */
+void* get_block_pointer(lba_t block)
+{
+	return (void*) (EEPROM_FS_START + EEPROM_FS_DATA_OFFSET
+			+ ((block * EEPROM_FS_BLOCK_SIZE) % EEPROM_FS_SIZE));
+}
+
+/**
+ * Returns the block following a block in its chain.
+ * Only the next_block field is read, not the block data.
+ *
+ * \param block Block to look up
+ * \return Address of the next block, or NULL if the block ends its chain
+ */
+lba_t next_block_in_chain(lba_t block)
+{
+	_fs_count(chain_hops, 1);
+
+	lba_t next;
+	read_eeprom((void*) &next, get_block_pointer(block), sizeof(lba_t));
+	return next;
+}
+
+/**
+ * Returns the block a given number of hops along a block chain.
+ * Only the next_block fields are read.
+ *
+ * \param block First block of the chain
+ * \param n Number of blocks to skip
+ * \return Address of the block, or NULL if the chain is too short
+ */
+lba_t nth_block_in_chain(lba_t block, uint16_t n)
+{
+	while (n > 0 && block >= 0 && block < (lba_t) EEPROM_FS_NUM_BLOCKS)
+	{
+		block = next_block_in_chain(block);
+		n--;
+	}
+	if (block < 0 || block >= (lba_t) EEPROM_FS_NUM_BLOCKS)
+	{
+		return NULL_PTR;
+	}
+	return block;
+}
+
+/**
+ * Returns a block of the file open in a file handle.
+ * For handles opened for appending, this is a block of the existing file.
+ *
+ * \param fh File handle
+ * \param n Index of the block in the file
+ * \return Address of the block, or NULL if the file is too short
+ */
+lba_t nth_block_of_file(file_handle_t* fh, uint16_t n)
+{
+#if EEPROM_FS_BLOCK_MAP
+	if (n < EEPROM_FS_MAX_BLOCKS_PER_FILE)
+	{
+		return fh->blocks[n];
+	}
+	return NULL_PTR;
+#else
+	if (fh->type == FH_APPEND)
+	{
+		return nth_block_in_chain(alloc_table[fh->filename].data_block, n);
+	}
+	return nth_block_in_chain(fh->first_block, n);
+#endif
+}
+
+/**
+ * Fill the block map of a file handle by walking the file's block chain.
+ * Does nothing if the block map is disabled.
+ *
+ * \param fh File handle, with filesize set
+ * \param block First block of the file
+ */
+void map_blocks(file_handle_t* fh, lba_t block)
+{
+#if EEPROM_FS_BLOCK_MAP
+	uint16_t num_blocks = (fh->filesize + EEPROM_FS_BLOCK_DATA_SIZE - 1)
+			/ EEPROM_FS_BLOCK_DATA_SIZE;
+
+	for (uint16_t i = 0; i < EEPROM_FS_MAX_BLOCKS_PER_FILE; i++)
+	{
+		if (i < num_blocks && block >= 0 && block < (lba_t) EEPROM_FS_NUM_BLOCKS)
+		{
+			fh->blocks[i] = block;
+			if (i + 1 < num_blocks)
+			{
+				block = next_block_in_chain(block);
+			}
+		}
+		else
+		{
+			fh->blocks[i] = NULL_PTR;
+		}
+	}
+#endif
+}
+
+/**
+ * Returns the last logical block of a block chain.
+ * A link to a block outside the filesystem, such as one cut short by a power
+ * failure, ends the chain too, and so does running past as many blocks as
+ * there are, so a damaged chain can't hang the search.
+ *
+ * \param block Any block in the block chain to look up
+ * \return Address of last block in the block chain, or NULL for failure
+ */
+lba_t last_block_in_chain(lba_t block)
+{
+	if (block >= 0 && block < (lba_t) EEPROM_FS_NUM_BLOCKS)
+	{
+		_fs_debug3("Searching for last block in chain...\n");
+
+		lba_t next = block;
+		uint16_t n = 0;
+		do
+		{
+			block = next;
+			_fs_debug4("checking... %d\n", block);
+			next = next_block_in_chain(block);
+		} while (next >= 0 && next < (lba_t) EEPROM_FS_NUM_BLOCKS
+				&& ++n < EEPROM_FS_NUM_BLOCKS);
+
+		_fs_debug3("Last block in chain: %d\n", block);
+
+		return block;
+	}
+	else
+	{
+		_fs_error("Block %d is not part of a block chain.\n", block);
+		return NULL_PTR;
+	}
+}
+
+/**
+ * Take a block out of the free block chain.
+ * Takes the first free block, or with EEPROM_FS_WEAR_AWARE, the least worn
+ * free block, which is unlinked from the chain.
+ *
+ * \return Address of the block, or NULL if there are no free blocks
+ */
+lba_t alloc_block()
+{
+#if EEPROM_FS_FREE_BITMAP
+	lba_t block = NULL_PTR;
+
+	// Carry on from the last block taken, so blocks are used in turn
+	for (uint16_t n = 0; n < EEPROM_FS_NUM_BLOCKS; n++)
+	{
+		lba_t i = (alloc_cursor + n) % EEPROM_FS_NUM_BLOCKS;
+		if (!block_is_free(i))
+		{
+			continue;
+		}
+#if EEPROM_FS_WEAR_AWARE
+		// As with the free chain, only pass over the first free block for a
+		// much less worn one, or take the most worn for wear_level()
+		if (block == NULL_PTR || (alloc_worn ?
+				block_wear[i] > block_wear[block] :
+				block_wear[i] + EEPROM_FS_WEAR_THRESHOLD < block_wear[block]))
+		{
+			block = i;
+		}
+#else
+		block = i;
+		break;
+#endif
+	}
+
+	if (block == NULL_PTR)
+	{
+		_fs_error("No free blocks left.\n");
+		return NULL_PTR;
+	}
+
+	set_block_free(block, 0);
+	alloc_cursor = (block + 1) % EEPROM_FS_NUM_BLOCKS;
+
+	return block;
+#else
+	lba_t block = *next_free_block;
+	lba_t prev = NULL_PTR;
+
+	if (block < 0 || block >= (lba_t) EEPROM_FS_NUM_BLOCKS)
+	{
+		_fs_error("Attempted to write to invalid block %d.\n", block);
+		return NULL_PTR;
+	}
+
+#if EEPROM_FS_WEAR_AWARE
+	// Search the free block chain for a much less worn block than the first,
+	// or for the most worn block
+	uint16_t target_wear = block_wear[block];
+	if (!alloc_worn)
+	{
+		target_wear = target_wear > EEPROM_FS_WEAR_THRESHOLD ?
+				target_wear - EEPROM_FS_WEAR_THRESHOLD : 0;
+	}
+	lba_t before = *next_free_block;
+	lba_t i = before;
+	for (uint16_t n = 1; n < EEPROM_FS_NUM_BLOCKS && i != last_free_block; n++)
+	{
+		i = next_block_in_chain(before);
+		if (i < 0 || i >= (lba_t) EEPROM_FS_NUM_BLOCKS)
+		{
+			break;
+		}
+		if (alloc_worn ?
+				block_wear[i] > target_wear : block_wear[i] < target_wear)
+		{
+			block = i;
+			prev = before;
+			target_wear = block_wear[i];
+		}
+		before = i;
+	}
+#endif
+
+	lba_t next = next_block_in_chain(block);
+	if (block == last_free_block)
+	{
+		// Taking the end of the free block chain
+		last_free_block = prev;
+		next = NULL_PTR;
+	}
+
+	if (prev == NULL_PTR)
+	{
+		*next_free_block = next;
+	}
+	else
+	{
+#if EEPROM_FS_MOUNT_SLOTS
+		// The stored free chain no longer matches the saved state
+		invalidate_mount_state();
+#endif
+		relink(prev, next);
+	}
+
+	_fs_debug3("Next free block: %d\n", *next_free_block);
+
+	return block;
+#endif
+}
+
+/**
+ * Writes a block of data to a free block
+ * Advances the cached next_free_block
+ *
+ * \param data Block data to write
+ * \param size Amount of data to write. The rest of the block is left as is.
+ * \return Address of block written, or NULL if failure
+ */
+lba_t write_block_data(const fdata_t* data, size_t size)
+{
+	lba_t write_to = alloc_block();
+
+	if (write_to != NULL_PTR)
+	{
+		_fs_count(blocks_allocated, 1);
+		_fs_debug2("Overwriting block %d...", write_to);
+
+#if EEPROM_FS_WEAR_AWARE
+		block_wear[write_to]++;
+		diff_write_block((void*) &block_wear[write_to], wear_pointer(write_to),
+				sizeof(uint16_t));
+#endif
+
+		// Write data only
+		void* addr = get_block_pointer(write_to)
+				+ (EEPROM_FS_BLOCK_SIZE - EEPROM_FS_BLOCK_DATA_SIZE);
+		diff_write_block((const void*) data, addr, size);
+
+		_fs_debug2("Done.\n");
+	}
+
+	return write_to;
+}
+
+/**
+ * Copies data out of a file's block chain, starting part way through a block.
+ * With EEPROM_FS_BLOCK_CRC, each block read through a handle opened for
+ * reading is copied into the handle's buffer and checked first, and copying
+ * stops at a corrupt one.
+ *
+ * \param fh File handle
+ * \param block Block holding the data at position, moved on to the block
+ * 				holding the data following the copied data
+ * \param position Position in the file to start copying from
+ * \param buf Buffer to copy data to
+ * \param size Amount of data to copy
+ * \return Amount of data copied
+ */
+size_t read_blocks(file_handle_t* fh, lba_t* block, size_t position,
+		fdata_t* buf, size_t size)
+{
+	size_t offset = position % EEPROM_FS_BLOCK_DATA_SIZE;
+	size_t done = 0;
+
+	while (done < size && *block >= 0 && *block < (lba_t) EEPROM_FS_NUM_BLOCKS)
+	{
+		size_t num_bytes = EEPROM_FS_BLOCK_DATA_SIZE - offset;
+		if (num_bytes > size - done)
+		{
+			num_bytes = size - done;
+		}
+
+		_fs_debug3("Reading %u bytes from block %d...", (unsigned int) num_bytes,
+				*block);
+#if EEPROM_FS_BLOCK_CRC
+		// Handles being written hold data the CRCs don't cover yet
+		if (fh->type == FH_READ)
+		{
+			uint16_t index = (position + done) / EEPROM_FS_BLOCK_DATA_SIZE;
+			if (*block != fh->checked_block || index != fh->checked_index)
+			{
+				// Read all of the block's data into the handle's buffer, so it
+				// can be checked, and read in pieces without reading it again
+				size_t used = fh->filesize - index * EEPROM_FS_BLOCK_DATA_SIZE;
+				if (used > EEPROM_FS_BLOCK_DATA_SIZE)
+				{
+					used = EEPROM_FS_BLOCK_DATA_SIZE;
+				}
+
+				fh->checked_block = NULL_PTR;
+				read_eeprom((void*) fh->buffer, get_block_pointer(*block)
+						+ (EEPROM_FS_BLOCK_SIZE - EEPROM_FS_BLOCK_DATA_SIZE),
+						used);
+				if (!block_intact(*block, fh->filename % EEPROM_FS_MAX_FILES,
+						index, used, fh->buffer))
+				{
+					_fs_error("Block %d of file %d is corrupt.\n", *block,
+							fh->filename);
+					break;
+				}
+				fh->checked_block = *block;
+				fh->checked_index = index;
+			}
+			memcpy(&buf[done], &fh->buffer[offset], num_bytes * sizeof(fdata_t));
+		}
+		else
+#endif
+		{
+			void* addr = get_block_pointer(*block)
+					+ (EEPROM_FS_BLOCK_SIZE - EEPROM_FS_BLOCK_DATA_SIZE)
+					+ offset;
+			read_eeprom((void*) &buf[done], addr, num_bytes);
+		}
+		_fs_debug3("Done.\n");
+
+		done += num_bytes;
+		offset += num_bytes;
+
+		// Move on once this block has been read to the end
+		if (offset == EEPROM_FS_BLOCK_DATA_SIZE)
+		{
+			*block = next_block_in_chain(*block);
+			offset = 0;
+		}
+	}
+
+	return done;
+}
+
+/**
+ * Writes the block buffer of a file handle to the next free address
+ * and adds the block to the handle's chain.
+ *
+ * \param fh File handle opened for writing or appending
+ * \param num_bytes Number of bytes held in the buffer
+ * \return Address of block written, or NULL if failure
+ */
+lba_t write_buffer(file_handle_t* fh, size_t num_bytes)
+{
+	lba_t block = write_block_data(fh->buffer, num_bytes);
+
+	if (block == NULL_PTR)
+	{
+		// Drop the buffered data so the file size matches what was written
+		fh->filesize -= num_bytes;
+	}
+	else
+	{
+		if (fh->first_block == NULL_PTR)
+		{
+			fh->first_block = block;
+		}
+		else
+		{
+#if EEPROM_FS_WEAR_AWARE || EEPROM_FS_FREE_BITMAP
+			// Blocks can come from anywhere
+			relink(fh->last_block, block);
+#else
+			// Blocks are taken in free chain order, so the chain links itself,
+			// unless another handle took a block in between
+			if (next_block_in_chain(fh->last_block) != block)
+			{
+				relink(fh->last_block, block);
+			}
+#endif
+		}
+		fh->last_block = block;
+
+#if EEPROM_FS_BLOCK_CRC
+		// The buffered data is already counted in the file size
+		uint16_t index = (fh->filesize - 1) / EEPROM_FS_BLOCK_DATA_SIZE;
+		block_crc_t crc = block_crc_update(
+				block_crc_seed(fh->filename % EEPROM_FS_MAX_FILES, index),
+				fh->buffer, num_bytes);
+		diff_write_block((void*) &crc, crc_pointer(block, 0),
+				sizeof(block_crc_t));
+#endif
+
+#if EEPROM_FS_BLOCK_MAP
+		fh->blocks[(fh->filesize - 1) / EEPROM_FS_BLOCK_DATA_SIZE] = block;
+#endif
+	}
+
+	return block;
+}
+
+/**
+ * Returns the end of the space left in the last block of a file being
+ * appended to. Data before this point is written straight into that block
+ * rather than buffered.
+ *
+ * \param fh File handle
+ * \return File offset where the existing last block ends, or 0 if the
+ * 			handle isn't appending
+ */
+size_t in_place_end(file_handle_t* fh)
+{
+	if (fh->type != FH_APPEND)
+	{
+		return 0;
+	}
+
+	size_t size = alloc_table[fh->filename].filesize;
+	return (size + EEPROM_FS_BLOCK_DATA_SIZE - 1) / EEPROM_FS_BLOCK_DATA_SIZE
+			* EEPROM_FS_BLOCK_DATA_SIZE;
+}
+
+/**
+ * Wrap a filename around in case it's larger than the maximum supported, so
+ * it can't reach the free space entry after the files in the allocation table
+ *
+ * \param filename Filename
+ * \return Filename below EEPROM_FS_MAX_FILES
+ */
+fname_t wrap_filename(fname_t filename)
+{
+	if (filename >= EEPROM_FS_MAX_FILES)
+	{
+		filename = filename % EEPROM_FS_MAX_FILES;
+		_fs_debug2("Filename too large - truncated to %d.\n", filename);
+	}
+	return filename;
+}
+
+/**
+ * Link a block chain to the allocation table, marking it as a file and removing
+ * it from the free block chain.
+ *
+ * \param fh File handle
+ * \param old_block First block of the chain the file replaces, freed once the
+ * 				file is linked, or NULL
+ * \param old_size Size of the file the replaced chain holds
+ */
+void link(file_handle_t* fh, lba_t old_block, size_t old_size)
+{
+	_fs_trace(TRACE_LINK, fh->filename % EEPROM_FS_MAX_FILES, fh->first_block);
+
+	if (fh->first_block >= 0 && fh->first_block < (lba_t) EEPROM_FS_NUM_BLOCKS)
+	{
+		_fs_debug1("Linking file %d to block %d.\n", fh->filename, fh->first_block);
+
+		// Wrap filename around in case it's larger than maximum supported
+		fname_t filename = fh->filename % EEPROM_FS_MAX_FILES;
+
+		alloc_table[filename].filesize = fh->filesize;
+		alloc_table[filename].data_block = fh->first_block;
+
+		// Store the entry along with the new start of the free block chain
+		commit_alloc(filename, old_block, old_size);
+
+		_fs_debug1("Link successful.\n");
+	}
+	else
+	{
+		_fs_error("Cannot link file %d to invalid block %d.\n", fh->filename,
+				fh->first_block);
+	}
+}
+
+/**
+ * Mark a block chain as free.
+ *
+ * \param first First block of the chain.
+ * 				Adds block to the end of the free block chain.
+ * \param last Last block of the chain
+ */
+void unlink(lba_t first, lba_t last)
+{
+	_fs_trace(TRACE_UNLINK, TRACE_NO_FILE, first);
+	_fs_count(unlinks, 1);
+	_fs_debug1("Unlinking block %d.\n", first);
+
+#if EEPROM_FS_FREE_BITMAP
+	// Nothing is written: the blocks are free once no file holds them
+	lba_t block = first;
+	for (uint16_t n = 0; n < EEPROM_FS_MAX_BLOCKS_PER_FILE && block >= 0
+			&& block < (lba_t) EEPROM_FS_NUM_BLOCKS; n++)
+	{
+		set_block_free(block, 1);
+		if (block == last)
+		{
+			break;
+		}
+		block = next_block_in_chain(block);
+	}
+#else
+	// The end of a file isn't marked, so end the chain before it joins the
+	// free block chain
+	relink(last, NULL_PTR);
+
+	if (last_free_block == NULL_PTR)
+	{
+		// Free block chain is empty, so the unlinked chain becomes the whole of it
+		*next_free_block = first;
+	}
+	else
+	{
+		// Add new block to the end of the free block chain
+		relink(last_free_block, first);
+	}
+
+	// The end of the unlinked chain is now the end of the free block chain
+	last_free_block = last;
+#endif
+
+	_fs_debug1("Unlink successful.\n");
+}
+
+/**
+ * Overwrite the next_block field of a given block without touching the data
+ *
+ * \param block Address of block to modify
+ * \param target Address of next block to link to
+ */
+void relink(lba_t block, lba_t target)
+{
+	_fs_trace(TRACE_RELINK, TRACE_NO_FILE, block);
+
+	if (block >= 0 && block < (lba_t) EEPROM_FS_NUM_BLOCKS)
+	{
+		if (target >= NULL_PTR && target < (lba_t) EEPROM_FS_NUM_BLOCKS)
+		{
+			_fs_count(relinks, 1);
+			_fs_debug3("Relinking block %d -> %d...", block, target);
+
+			// Write address only
+			diff_write_block((void*) &target, get_block_pointer(block),
+					sizeof(lba_t));
+
+			_fs_debug3("Done.\n");
+		}
+		else
+		{
+			_fs_error("Attempted to relink to invalid block %d.\n", target);
+		}
+	}
+	else
+	{
+		_fs_error("Attempted to write to invalid block %d.\n", block);
+	}
+}
+
+/**
+ * Check the stored metadata against the compiled filesystem layout
+ *
+ * \return 1 if the EEPROM holds a filesystem with this layout, 0 if not
+ */
+uint8_t meta_matches()
+{
+	_fs_debug2("Loading metadata...");
+	fs_meta_t stored_meta;
+	read_eeprom((void*) &stored_meta,
+			(void*) (EEPROM_FS_START + EEPROM_FS_META_OFFSET),
+			sizeof(fs_meta_t));
+	_fs_debug2("Done.\n");
+
+	return stored_meta.block_size == EEPROM_FS_BLOCK_SIZE
+			&& stored_meta.start_address == EEPROM_FS_START
+			&& stored_meta.fs_size == EEPROM_FS_SIZE
+			&& stored_meta.max_files == EEPROM_FS_MAX_FILES
+			&& stored_meta.max_blocks_per_file == EEPROM_FS_MAX_BLOCKS_PER_FILE
+			&& stored_meta.journal_slots == EEPROM_FS_JOURNAL_SLOTS
+			&& stored_meta.block_data_size == EEPROM_FS_BLOCK_DATA_SIZE
+			&& stored_meta.free_bitmap == EEPROM_FS_FREE_BITMAP
+			&& stored_meta.mount_slots == EEPROM_FS_MOUNT_SLOTS
+			&& stored_meta.block_crc == EEPROM_FS_BLOCK_CRC;
+}
+
+/**
+ * Store an entry of the allocation table, along with the start of the free
+ * block chain, then free the chain the entry replaced.
+ * With a journal, this appends a record to the journal, compacting the
+ * journal into a new checkpoint once the ring of slots is full. The
+ * record commits the change in one go: if the system fails before the
+ * record is complete, the old entry stands, and if it fails while the old
+ * chain is being freed, finish_unlink() frees it when mounting.
+ *
+ * \param index Entry to store
+ * \param old_block First block of the chain the entry replaced, or NULL
+ * \param old_size Size of the file the replaced chain holds
+ */
+void commit_alloc(fname_t index, lba_t old_block, size_t old_size)
+{
+	lba_t old_last = NULL_PTR;
+	if (old_block != NULL_PTR)
+	{
+		old_last = nth_block_in_chain(old_block,
+				old_size > 0 ? (old_size - 1) / EEPROM_FS_BLOCK_DATA_SIZE : 0);
+		if (old_last < 0 || old_last >= (lba_t) EEPROM_FS_NUM_BLOCKS)
+		{
+			_fs_error("Cannot unlink invalid block %d.\n", old_block);
+			old_block = NULL_PTR;
+			old_last = NULL_PTR;
+		}
+	}
+
+#if !EEPROM_FS_FREE_BITMAP
+	if (old_block != NULL_PTR && last_free_block == NULL_PTR)
+	{
+		// Free block chain is empty, so the old chain is about to become the
+		// whole of it
+		*next_free_block = old_block;
+	}
+#endif
+
+#if EEPROM_FS_JOURNAL_SLOTS
+	fs_journal_record_t record;
+	record.seq = journal_seq + 1;
+	record.file = index;
+	record.crc = 0;
+	record.alloc = alloc_table[index];
+	record.free_block = *next_free_block;
+	record.old_first = old_block;
+	record.old_last = old_last;
+	record.crc = crc8((void*) &record, sizeof(fs_journal_record_t));
+
+	_fs_debug3("Writing journal record %u for entry %d...", record.seq, index);
+	write_sequenced((void*) &record, journal_slot_pointer(record.seq),
+			sizeof(fs_journal_record_t));
+	_fs_debug3("Done.\n");
+
+	journal_seq = record.seq;
+#if EEPROM_FS_MOUNT_SLOTS
+	mount_state_saved = 0;
+#endif
+#else
+	// The free chain is found by scan_free_chain() when mounting instead.
+	// The entry is rewritten in place, so a power failure here can leave it
+	// half written.
+	void* alloc_offset = (void*) (EEPROM_FS_START + EEPROM_FS_ALLOC_TABLE_OFFSET
+			+ index * sizeof(file_alloc_t));
+	diff_write_block((void*) &alloc_table[index], alloc_offset,
+			sizeof(file_alloc_t));
+#endif
+
+	if (old_block != NULL_PTR)
+	{
+		unlink(old_block, old_last);
+	}
+
+#if EEPROM_FS_JOURNAL_SLOTS
+	compact_journal();
+#endif
+}
+
+/**
+ * Load the allocation table from storage into the cache.
+ * With a journal, this loads the newest intact checkpoint and replays the
+ * journal records written after it.
+ */
+void load_alloc_table()
+{
+#if EEPROM_FS_JOURNAL_SLOTS
+	// Only read the whole of the older checkpoint if the newer is damaged
+	uint16_t seq[2];
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		read_eeprom((void*) &seq[i],
+				checkpoint_pointer(i) + offsetof(fs_checkpoint_t, seq),
+				sizeof(uint16_t));
+	}
+
+	// Allow for the sequence number wrapping
+	uint8_t newest = (int16_t) (seq[1] - seq[0]) > 0 ? 1 : 0;
+	fs_checkpoint_t cp;
+	uint8_t valid = 0;
+	for (uint8_t i = 0; i < 2 && !valid; i++)
+	{
+		checkpoint_copy = newest ^ i;
+		read_eeprom((void*) &cp, checkpoint_pointer(checkpoint_copy),
+				sizeof(fs_checkpoint_t));
+
+		uint8_t crc = cp.crc;
+		cp.crc = 0;
+		valid = crc8((void*) &cp, sizeof(fs_checkpoint_t)) == crc;
+	}
+
+	if (!valid)
+	{
+		_fs_error("No intact allocation table checkpoint - reformatting.\n");
+		format_eepromfs(FORMAT_QUICK);
+		return;
+	}
+
+	memcpy(alloc_table, cp.table, sizeof(alloc_table));
+	checkpoint_seq = cp.seq;
+	journal_seq = checkpoint_seq;
+
+	_fs_debug3("Checkpoint %d at record %u.\n", checkpoint_copy,
+			checkpoint_seq);
+
+#if !EEPROM_FS_FREE_BITMAP
+	replayed_first = NULL_PTR;
+	replayed_last = NULL_PTR;
+#endif
+
+	// Replay records until one is missing or damaged
+	for (uint16_t i = 0; i < EEPROM_FS_JOURNAL_SLOTS; i++)
+	{
+		fs_journal_record_t record;
+		uint16_t seq = journal_seq + 1;
+		read_eeprom((void*) &record, journal_slot_pointer(seq),
+				sizeof(fs_journal_record_t));
+
+		uint8_t crc = record.crc;
+		record.crc = 0;
+		if (record.seq != seq || record.file >= EEPROM_FS_MAX_FILES
+				|| crc8((void*) &record, sizeof(fs_journal_record_t)) != crc)
+		{
+			break;
+		}
+
+		_fs_debug4("Replaying record %u for entry %d.\n", seq, record.file);
+
+		alloc_table[record.file] = record.alloc;
+		*next_free_block = record.free_block;
+		journal_seq = seq;
+#if !EEPROM_FS_FREE_BITMAP
+		replayed_first = record.old_first;
+		replayed_last = record.old_last;
+#endif
+	}
+
+	_fs_debug3("Journal replayed to record %u.\n", journal_seq);
+
+#if !EEPROM_FS_FREE_BITMAP
+	if (replayed_first != NULL_PTR)
+	{
+		// The last commit may have been cut short before the end of the chain
+		// it replaced was marked, and the free block chain could run on
+		// through it
+		relink(replayed_last, NULL_PTR);
+	}
+#endif
+#else
+	read_eeprom(alloc_table,
+			(void*) (EEPROM_FS_START + EEPROM_FS_ALLOC_TABLE_OFFSET),
+			sizeof(alloc_table));
+#endif
+}
+
+/**
+ * Rebuild the free space state that isn't stored: the free bitmap, or the
+ * ends of the free block chain
+ */
+void find_free_space()
+{
+#if EEPROM_FS_FREE_BITMAP
+	build_free_bitmap();
+#elif EEPROM_FS_JOURNAL_SLOTS
+	// Find the tail of the free block chain once, so unlink() doesn't have to
+	if (*next_free_block != NULL_PTR)
+	{
+		last_free_block = last_block_in_chain(*next_free_block);
+
+		// Its link may have been cut short on its way to NULL
+		relink(last_free_block, NULL_PTR);
+	}
+	else
+	{
+		last_free_block = NULL_PTR;
+	}
+#else
+	scan_free_chain();
+#endif
+}
+
+/**
+ * Mark the blocks held by files in a bitmap, walking each file's chain only
+ * as far as its size
+ *
+ * \param used Bitmap of EEPROM_FS_NUM_BLOCKS bits to fill
+ */
+void mark_file_blocks(uint8_t* used)
+{
+	memset(used, 0, (EEPROM_FS_NUM_BLOCKS + 7) / 8);
+
+	for (uint16_t i = 0; i < EEPROM_FS_MAX_FILES; i++)
+	{
+		uint16_t num_blocks = (alloc_table[i].filesize
+				+ EEPROM_FS_BLOCK_DATA_SIZE - 1) / EEPROM_FS_BLOCK_DATA_SIZE;
+		lba_t block = alloc_table[i].data_block;
+
+		for (uint16_t n = 0; n < num_blocks && block >= 0
+				&& block < (lba_t) EEPROM_FS_NUM_BLOCKS; n++)
+		{
+			used[block / 8] |= 1 << (block % 8);
+			block = next_block_in_chain(block);
+		}
+	}
+}
+
+/**
+ * Check a file's block chain against its size. The file is cut short at the
+ * first block that is outside the filesystem, or already held by a file,
+ * including its own chain looping back. A file too large to be valid is
+ * removed.
+ *
+ * \param file File to check
+ * \param used Bitmap of the blocks held by the files checked so far, which
+ *             the file's blocks are added to
+ * \return Number of problems found
+ */
+uint16_t fsck_file(fname_t file, uint8_t* used)
+{
+	file_alloc_t* entry = &alloc_table[file];
+	if (entry->data_block == NULL_PTR && entry->filesize == 0)
+	{
+		return 0;
+	}
+
+	// The end of a file isn't marked, so walk only as far as its size. A
+	// size too large for any file is damaged, and would lead the walk on into
+	// other files' blocks.
+	uint16_t num_blocks = (entry->filesize + EEPROM_FS_BLOCK_DATA_SIZE - 1)
+			/ EEPROM_FS_BLOCK_DATA_SIZE;
+	if (num_blocks > EEPROM_FS_MAX_BLOCKS_PER_FILE)
+	{
+		num_blocks = 0;
+	}
+	lba_t block = entry->data_block;
+	uint16_t n = 0;
+	while (n < num_blocks && block >= 0 && block < (lba_t) EEPROM_FS_NUM_BLOCKS
+			&& !(used[block / 8] & (1 << (block % 8))))
+	{
+		used[block / 8] |= 1 << (block % 8);
+		if (++n < num_blocks)
+		{
+			block = next_block_in_chain(block);
+		}
+	}
+
+	if (n == num_blocks && n > 0)
+	{
+		return 0;
+	}
+
+	if (n == 0)
+	{
+		_fs_error("File %d of %d bytes has no valid blocks - removed.\n", file,
+				entry->filesize);
+		entry->data_block = NULL_PTR;
+		entry->filesize = 0;
+	}
+	else
+	{
+		_fs_error("File %d runs into block %d - cut to %d blocks.\n", file,
+				block, n);
+		entry->filesize = n * EEPROM_FS_BLOCK_DATA_SIZE;
+	}
+
+	// Blocks cut off the file are freed along with any others no file holds
+	commit_alloc(file, NULL_PTR, 0);
+	return 1;
+}
+
+/**
+ * Check the free space holds every block no file does, and nothing else.
+ * The free block chain is kept up to the first block that is outside the
+ * filesystem, held by a file or already in the chain, and the blocks in
+ * neither a file nor the chain are added after that.
+ *
+ * \param used Bitmap of the blocks held by files
+ * \return Number of problems found
+ */
+uint16_t fsck_free_space(const uint8_t* used)
+{
+	uint16_t problems = 0;
+
+#if EEPROM_FS_FREE_BITMAP
+	uint16_t wrong = 0;
+	for (lba_t i = 0; i < (lba_t) EEPROM_FS_NUM_BLOCKS; i++)
+	{
+		if (block_is_free(i) == ((used[i / 8] >> (i % 8)) & 1))
+		{
+			wrong++;
+		}
+	}
+	if (wrong > 0)
+	{
+		_fs_error("%d blocks marked wrongly in the free bitmap.\n", wrong);
+		build_free_bitmap();
+		problems++;
+	}
+#else
+	uint8_t in_chain[(EEPROM_FS_NUM_BLOCKS + 7) / 8];
+	memset(in_chain, 0, sizeof(in_chain));
+
+	// Every block visited is new to the chain, so the walk is bounded
+	lba_t tail = NULL_PTR;
+	lba_t block = *next_free_block;
+	while (block != NULL_PTR)
+	{
+		if (block < 0 || block >= (lba_t) EEPROM_FS_NUM_BLOCKS)
+		{
+			_fs_error("Free block chain runs off the filesystem.\n");
+			break;
+		}
+		if (in_chain[block / 8] & (1 << (block % 8)))
+		{
+			_fs_error("Free block chain loops back to block %d.\n", block);
+			break;
+		}
+		if (used[block / 8] & (1 << (block % 8)))
+		{
+			_fs_error("Free block %d is in a file.\n", block);
+			break;
+		}
+		in_chain[block / 8] |= 1 << (block % 8);
+		tail = block;
+		block = next_block_in_chain(block);
+	}
+
+	lba_t head = tail == NULL_PTR ? NULL_PTR : *next_free_block;
+	if (block != NULL_PTR)
+	{
+		// End the chain at its last good block
+		if (tail != NULL_PTR)
+		{
+			relink(tail, NULL_PTR);
+		}
+		problems++;
+	}
+	else if (tail != last_free_block)
+	{
+		_fs_error("Free block chain ends at block %d, not %d.\n", tail,
+				last_free_block);
+		problems++;
+	}
+
+	// Chain the blocks in neither together before the free block chain links
+	// to them, so it only ever runs into a finished chain
+	lba_t first_lost = NULL_PTR;
+	lba_t last_lost = NULL_PTR;
+	uint16_t num_lost = 0;
+	for (lba_t i = 0; i < (lba_t) EEPROM_FS_NUM_BLOCKS; i++)
+	{
+		if ((used[i / 8] | in_chain[i / 8]) & (1 << (i % 8)))
+		{
+			continue;
+		}
+		if (last_lost == NULL_PTR)
+		{
+			first_lost = i;
+		}
+		else
+		{
+			relink(last_lost, i);
+		}
+		last_lost = i;
+		num_lost++;
+	}
+
+	if (num_lost > 0)
+	{
+		_fs_error("%d blocks in neither a file nor the free space - freed.\n",
+				num_lost);
+		relink(last_lost, NULL_PTR);
+		if (tail == NULL_PTR)
+		{
+			head = first_lost;
+		}
+		else
+		{
+			relink(tail, first_lost);
+		}
+		tail = last_lost;
+		problems++;
+	}
+
+	last_free_block = tail;
+	if (head != *next_free_block)
+	{
+		*next_free_block = head;
+#if EEPROM_FS_JOURNAL_SLOTS
+		// Every journal record stores the start of the free block chain, so
+		// store file 0's entry again along with the new start
+		commit_alloc(0, NULL_PTR, 0);
+#endif
+	}
+#endif
+
+#if EEPROM_FS_MOUNT_SLOTS
+	if (problems > 0)
+	{
+		// The saved free space state is out of date
+		invalidate_mount_state();
+	}
+#endif
+
+	return problems;
+}
+
+#if EEPROM_FS_FREE_BITMAP
+/**
+ * Rebuild the free block bitmap: every block not held by a file is free
+ */
+void build_free_bitmap()
+{
+	mark_file_blocks(free_bitmap);
+
+	num_free_blocks = 0;
+	for (lba_t i = 0; i < (lba_t) EEPROM_FS_NUM_BLOCKS; i++)
+	{
+		free_bitmap[i / 8] ^= 1 << (i % 8);
+		if (block_is_free(i))
+		{
+			num_free_blocks++;
+		}
+	}
+
+#if EEPROM_FS_JOURNAL_SLOTS
+	// Start somewhere new after each mount, rather than back at block 0
+	alloc_cursor = journal_seq % EEPROM_FS_NUM_BLOCKS;
+#endif
+}
+
+/**
+ * Returns 1 if a block is free, 0 if not
+ */
+uint8_t block_is_free(lba_t block)
+{
+	return (free_bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+/**
+ * Mark a block as free or in use in the free block bitmap
+ *
+ * \param block Block to mark
+ * \param free 1 to mark the block as free, 0 as in use
+ */
+void set_block_free(lba_t block, uint8_t free)
+{
+	if (block_is_free(block) == free)
+	{
+		return;
+	}
+
+	if (free)
+	{
+		free_bitmap[block / 8] |= 1 << (block % 8);
+		num_free_blocks++;
+	}
+	else
+	{
+		free_bitmap[block / 8] &= ~(1 << (block % 8));
+		num_free_blocks--;
+	}
+}
+#endif
+
+#if !EEPROM_FS_JOURNAL_SLOTS && !EEPROM_FS_FREE_BITMAP
+/**
+ * Find both ends of the free block chain from the block links.
+ * Without a journal, the start of the free chain would otherwise have to be
+ * rewritten in the allocation table on every commit.
+ *
+ * Every block not in a file is free. The start of the chain is the free
+ * block that no other free block links to, and the end is the free block
+ * that doesn't link to another free block.
+ */
+void scan_free_chain()
+{
+	uint8_t used[(EEPROM_FS_NUM_BLOCKS + 7) / 8];
+	uint8_t linked[(EEPROM_FS_NUM_BLOCKS + 7) / 8];
+	mark_file_blocks(used);
+	memset(linked, 0, sizeof(linked));
+
+	// Mark the free blocks that another free block links to
+	last_free_block = NULL_PTR;
+	for (lba_t i = 0; i < (lba_t) EEPROM_FS_NUM_BLOCKS; i++)
+	{
+		if (used[i / 8] & (1 << (i % 8)))
+		{
+			continue;
+		}
+
+		lba_t next = next_block_in_chain(i);
+		if (next >= 0 && next < (lba_t) EEPROM_FS_NUM_BLOCKS
+				&& !(used[next / 8] & (1 << (next % 8))))
+		{
+			linked[next / 8] |= 1 << (next % 8);
+		}
+		else
+		{
+			last_free_block = i;
+		}
+	}
+
+	*next_free_block = NULL_PTR;
+	for (lba_t i = 0; i < (lba_t) EEPROM_FS_NUM_BLOCKS; i++)
+	{
+		if (!((used[i / 8] | linked[i / 8]) & (1 << (i % 8))))
+		{
+			*next_free_block = i;
+			break;
+		}
+	}
+}
+#endif
+
+#if EEPROM_FS_JOURNAL_SLOTS && !EEPROM_FS_FREE_BITMAP
+/**
+ * Free the chain replaced by the last journal record, if the system failed
+ * before close() or delete() had added it to the free block chain.
+ * load_alloc_table() has already ended the chain, so once it has been added,
+ * it ends the free block chain.
+ */
+void finish_unlink()
+{
+#if !EEPROM_FS_WEAR_AWARE
+	if (replayed_first != NULL_PTR && last_free_block != replayed_last)
+	{
+		_fs_debug1("Finishing interrupted unlink of block %d.\n",
+				replayed_first);
+		unlink(replayed_first, replayed_last);
+	}
+#endif
+	// With EEPROM_FS_WEAR_AWARE, blocks are taken from the middle of the free
+	// block chain without a journal record, so it may have changed since the
+	// record. Adding the chain again could loop the free block chain, so the
+	// blocks are left unused instead, until fsck_eepromfs() frees them.
+}
+#endif
+
+#if EEPROM_FS_JOURNAL_SLOTS
+/**
+ * Compact the journal into a new checkpoint if the ring of slots is full, so
+ * the next record doesn't overwrite one the checkpoint doesn't hold yet.
+ * The cached table must match the journal, with no change to it pending, as
+ * it is after a commit has finished or once mounted.
+ */
+void compact_journal()
+{
+	if ((uint16_t) (journal_seq - checkpoint_seq) >= EEPROM_FS_JOURNAL_SLOTS)
+	{
+		_fs_debug2("Compacting journal at record %u...", journal_seq);
+		checkpoint_copy ^= 1;
+		write_checkpoint(checkpoint_copy, journal_seq);
+		checkpoint_seq = journal_seq;
+		_fs_debug2("Done.\n");
+	}
+}
+
+/**
+ * Write a stored record that ends with its sequence number. The sequence
+ * number is written after the rest of the record, so the record is only
+ * recognised once all of it has been stored.
+ *
+ * \param src Record to write
+ * \param dst Storage address to write to
+ * \param n Size of the record, including the sequence number
+ */
+void write_sequenced(const void* src, void* dst, size_t n)
+{
+	size_t body = n - sizeof(uint16_t);
+
+	diff_write_block(src, dst, body);
+	diff_write_block(src + body, dst + body, sizeof(uint16_t));
+}
+
+/**
+ * Write the cached allocation table to a checkpoint
+ *
+ * \param copy Checkpoint copy to overwrite, 0 or 1
+ * \param seq Sequence number of the last journal record held in the table
+ */
+void write_checkpoint(uint8_t copy, uint16_t seq)
+{
+	fs_checkpoint_t cp;
+	cp.seq = seq;
+	cp.crc = 0;
+	cp.reserved = 0;
+	memcpy(cp.table, alloc_table, sizeof(alloc_table));
+	cp.crc = crc8((void*) &cp, sizeof(fs_checkpoint_t));
+
+	write_sequenced((void*) &cp, checkpoint_pointer(copy),
+			sizeof(fs_checkpoint_t));
+}
+
+/**
+ * Check both copies of the allocation table checkpoint, and write the table
+ * over a damaged copy. load_alloc_table() only loads an intact copy, so a
+ * damaged one is never the copy in use.
+ *
+ * \return Number of problems found
+ */
+uint16_t fsck_checkpoints()
+{
+	uint16_t problems = 0;
+	uint8_t damaged = 0;
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		fs_checkpoint_t cp;
+		read_eeprom((void*) &cp, checkpoint_pointer(i), sizeof(fs_checkpoint_t));
+
+		uint8_t crc = cp.crc;
+		cp.crc = 0;
+		if (crc8((void*) &cp, sizeof(fs_checkpoint_t)) != crc)
+		{
+			_fs_error("Checkpoint %d is damaged.\n", i);
+			damaged |= 1 << i;
+			problems++;
+		}
+	}
+
+	if (problems > 0)
+	{
+		// Take a new checkpoint onto the older copy, as a compaction would
+		checkpoint_copy ^= 1;
+		write_checkpoint(checkpoint_copy, journal_seq);
+		checkpoint_seq = journal_seq;
+
+		// If the copy that was newest is damaged too, it now holds nothing
+		// the new one doesn't, so it can be rewritten in place
+		if (damaged & (1 << (checkpoint_copy ^ 1)))
+		{
+			write_checkpoint(checkpoint_copy ^ 1, journal_seq);
+		}
+	}
+	return problems;
+}
+
+/**
+ * Returns the EEPROM pointer to a checkpoint copy
+ *
+ * \param copy Checkpoint copy, 0 or 1
+ */
+void* checkpoint_pointer(uint8_t copy)
+{
+	return (void*) (EEPROM_FS_START + EEPROM_FS_CHECKPOINT_OFFSET
+			+ copy * sizeof(fs_checkpoint_t));
+}
+
+/**
+ * Returns the EEPROM pointer to the journal slot holding a record
+ *
+ * \param seq Sequence number of the record
+ */
+void* journal_slot_pointer(uint16_t seq)
+{
+	return (void*) (EEPROM_FS_START + EEPROM_FS_JOURNAL_OFFSET
+			+ (seq % EEPROM_FS_JOURNAL_SLOTS) * sizeof(fs_journal_record_t));
+}
+
+/**
+ * Dallas/Maxim CRC8 of a block of memory
+ *
+ * \param data Data to check
+ * \param n Number of bytes
+ */
+uint8_t crc8(const void* data, size_t n)
+{
+	const uint8_t* bytes = (const uint8_t*) data;
+	uint8_t crc = 0;
+
+	for (size_t i = 0; i < n; i++)
+	{
+#ifdef __AVR__
+		crc = _crc_ibutton_update(crc, bytes[i]);
+#else
+		crc ^= bytes[i];
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 0x01) ? (crc >> 1) ^ 0x8C : crc >> 1;
+		}
+#endif
+	}
+
+	return crc;
+}
+#endif
+
+#if EEPROM_FS_MOUNT_SLOTS
+/**
+ * Load the free space state saved by unmount_eepromfs(), if it was saved
+ * with the journal at its current record
+ *
+ * \return 1 if the state was loaded, 0 if it has to be rebuilt
+ */
+uint8_t load_mount_state()
+{
+	mount_state_saved = 0;
+
+	fs_mount_state_t state;
+	read_eeprom((void*) &state, mount_slot_pointer(journal_seq),
+			sizeof(fs_mount_state_t));
+
+	uint8_t crc = state.crc;
+	state.crc = 0;
+	if (state.seq != journal_seq
+			|| crc8((void*) &state, sizeof(fs_mount_state_t)) != crc)
+	{
+		_fs_debug2("No saved state for record %u.\n", journal_seq);
+		return 0;
+	}
+
+	last_free_block = state.last_free_block;
+#if EEPROM_FS_FREE_BITMAP
+	alloc_cursor = state.alloc_cursor;
+	memcpy(free_bitmap, state.free_bitmap, sizeof(free_bitmap));
+	num_free_blocks = 0;
+	for (lba_t i = 0; i < (lba_t) EEPROM_FS_NUM_BLOCKS; i++)
+	{
+		num_free_blocks += block_is_free(i);
+	}
+#endif
+
+	mount_state_saved = 1;
+
+	_fs_debug2("Loaded saved state for record %u.\n", journal_seq);
+	return 1;
 }
 
 /**
- * Link a block chain to the allocation table, marking it as a file and removing
- * it from the free block chain.
+ * Save the free space state in the mount slot for the current journal
+ * record
+ */
+void save_mount_state()
+{
+	fs_mount_state_t state;
+	memset(&state, 0, sizeof(fs_mount_state_t));
+	state.seq = journal_seq;
+	state.last_free_block = last_free_block;
+#if EEPROM_FS_FREE_BITMAP
+	state.alloc_cursor = alloc_cursor;
+	memcpy(state.free_bitmap, free_bitmap, sizeof(free_bitmap));
+#endif
+	state.crc = crc8((void*) &state, sizeof(fs_mount_state_t));
+
+	_fs_debug2("Saving state for record %u...", journal_seq);
+	write_sequenced((void*) &state, mount_slot_pointer(journal_seq),
+			sizeof(fs_mount_state_t));
+	_fs_debug2("Done.\n");
+
+	mount_state_saved = 1;
+}
+
+/**
+ * Stop the saved state being loaded, once the free block chain has been
+ * changed without a new journal record
+ */
+void invalidate_mount_state()
+{
+	if (mount_state_saved)
+	{
+		uint16_t stale = journal_seq - EEPROM_FS_MOUNT_SLOTS;
+		diff_write_block((void*) &stale, mount_slot_pointer(journal_seq)
+				+ offsetof(fs_mount_state_t, seq), sizeof(uint16_t));
+		mount_state_saved = 0;
+	}
+}
+
+/**
+ * Returns the EEPROM pointer to the mount slot for a journal record
  *
- * \param fh File handle
+ * \param seq Sequence number of the record
  */
-void link(file_handle_t* fh)
+void* mount_slot_pointer(uint16_t seq)
 {
-	if (fh->first_block >= 0 && fh->first_block < (lba_t) EEPROM_FS_NUM_BLOCKS)
+	return (void*) (EEPROM_FS_START + EEPROM_FS_MOUNT_OFFSET
+			+ (seq % EEPROM_FS_MOUNT_SLOTS) * sizeof(fs_mount_state_t));
+}
+#endif
+
+#if EEPROM_FS_WEAR_AWARE
+/**
+ * Load the wear counts of every block into the cache
+ */
+void load_block_wear()
+{
+	for (lba_t i = 0; i < (lba_t) EEPROM_FS_NUM_BLOCKS; i++)
 	{
-		_fs_debug1("Linking file %d to block %d.\n", fh->filename, fh->first_block);
+		read_eeprom((void*) &block_wear[i], wear_pointer(i), sizeof(uint16_t));
+	}
+}
 
-		// Wrap filename around in case it's larger than maximum supported
-		fname_t filename = fh->filename % EEPROM_FS_MAX_FILES;
+/**
+ * Returns the EEPROM pointer to the wear count of a block
+ *
+ * \param block Logical block
+ */
+void* wear_pointer(lba_t block)
+{
+	return get_block_pointer(block) + sizeof(lba_t);
+}
+#endif
 
-		alloc_table[filename].filesize = fh->filesize;
-		alloc_table[filename].data_block = fh->first_block;
+#if EEPROM_FS_BLOCK_CRC
+/**
+ * Returns the CRC a block's data starts from, which ties the block to its
+ * place in a file
+ *
+ * \param file File the block belongs to
+ * \param index Index of the block in the file
+ */
+block_crc_t block_crc_seed(fname_t file, uint16_t index)
+{
+	uint16_t id[2] = { file, index };
+	return block_crc_update(0, (void*) id, sizeof(id));
+}
 
-		// Update table in memory
-		// Data
-		void* alloc_offset =
-				(void*) (EEPROM_FS_START + EEPROM_FS_ALLOC_TABLE_OFFSET
-						+ filename * sizeof(file_alloc_t));
-		eeprom_update_block((void*) &alloc_table[filename], alloc_offset,
-				sizeof(file_alloc_t));
-
-		// New free (this needs adjustment for better write levelling)
-		void* free_offset = (void*) (EEPROM_FS_START
-				+ EEPROM_FS_ALLOC_TABLE_OFFSET
-				+ EEPROM_FS_MAX_FILES * sizeof(file_alloc_t));
-		eeprom_update_block((void*) &alloc_table[EEPROM_FS_MAX_FILES],
-				free_offset, sizeof(file_alloc_t));
+/**
+ * Continue a block CRC over a block of memory.
+ * CRC-16 is CRC-16/ARC (polynomial 0xA001 reflected), and CRC-8 is the
+ * Dallas/Maxim CRC8, as computed by avr-libc's _crc16_update() and
+ * _crc_ibutton_update().
+ *
+ * \param crc CRC so far
+ * \param data Data to check
+ * \param n Number of bytes
+ */
+block_crc_t block_crc_update(block_crc_t crc, const void* data, size_t n)
+{
+	const uint8_t* bytes = (const uint8_t*) data;
 
-		_fs_debug1("Link successful.\n");
+	for (size_t i = 0; i < n; i++)
+	{
+#ifdef __AVR__
+#if EEPROM_FS_BLOCK_CRC == 16
+		crc = _crc16_update(crc, bytes[i]);
+#else
+		crc = _crc_ibutton_update(crc, bytes[i]);
+#endif
+#else
+		crc ^= bytes[i];
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+#if EEPROM_FS_BLOCK_CRC == 16
+			crc = (crc & 0x0001) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+#else
+			crc = (crc & 0x01) ? (crc >> 1) ^ 0x8C : crc >> 1;
+#endif
+		}
+#endif
 	}
-	else
+
+	return crc;
+}
+
+/**
+ * Continue a block CRC over part of the data stored in a block
+ *
+ * \param block Logical block
+ * \param crc CRC so far
+ * \param start Offset into the block's data to start from
+ * \param end Offset into the block's data to stop at
+ */
+block_crc_t stored_data_crc(lba_t block, block_crc_t crc, size_t start,
+		size_t end)
+{
+	fdata_t chunk[16];
+	const void* addr = get_block_pointer(block)
+			+ (EEPROM_FS_BLOCK_SIZE - EEPROM_FS_BLOCK_DATA_SIZE) + start;
+
+	while (start < end)
 	{
-		_fs_error("Cannot link file %d to invalid block %d.\n", fh->filename,
-				fh->first_block);
+		size_t num_bytes = end - start < sizeof(chunk) ? end - start
+				: sizeof(chunk);
+		read_eeprom((void*) chunk, addr, num_bytes);
+		crc = block_crc_update(crc, (void*) chunk, num_bytes);
+		addr += num_bytes;
+		start += num_bytes;
 	}
+
+	return crc;
 }
 
 /**
- * Mark a block and all subsequent blocks in the chain as free.
+ * Check a block's data against either copy of its CRC
  *
- * \param block Block to mark as free.
- * 				Adds block to the end of the free block chain.
+ * \param block Logical block
+ * \param file File the block belongs to
+ * \param index Index of the block in the file
+ * \param used Number of bytes of data in use
+ * \param data Copy of the data in use, or NULL to read it from the block
+ * \return 1 if the data matches, 0 if it is corrupt
  */
-void unlink(lba_t block)
+uint8_t block_intact(lba_t block, fname_t file, uint16_t index, size_t used,
+		const fdata_t* data)
 {
-	if (block >= 0 && block < (lba_t) EEPROM_FS_NUM_BLOCKS)
+	block_crc_t crc = block_crc_seed(file, index);
+	if (data != NULL)
 	{
-		_fs_debug1("Unlinking block %d.\n", block);
+		crc = block_crc_update(crc, (const void*) data, used);
+	}
+	else
+	{
+		crc = stored_data_crc(block, crc, 0, used);
+	}
 
-		// Get current last free block
-		lba_t last_free = last_block_in_chain(*next_free_block);
-		block_t last_free_block;
-		eeprom_read_block((void*) &last_free_block,
-				get_block_pointer(last_free), EEPROM_FS_BLOCK_SIZE);
+	block_crc_t stored[2];
+	read_eeprom((void*) stored, crc_pointer(block, 0), sizeof(stored));
 
-		// Add new block to the end of the free block chain
-		last_free_block.next_block = block;
+	return stored[0] == crc || stored[1] == crc;
+}
 
-		// Write back address only
-		eeprom_write_block((void*) &last_free_block,
-				get_block_pointer(last_free), sizeof(lba_t));
+/**
+ * Update the CRC of the old last block of a file being appended to, once
+ * data has been appended to it in place. The new CRC goes in the copy not
+ * holding the old one, so until the file is committed, the old data still
+ * matches.
+ *
+ * \param fh File handle opened for appending
+ * \param old_size Size of the file before appending
+ */
+void update_block_crc(file_handle_t* fh, size_t old_size)
+{
+	fname_t file = fh->filename % EEPROM_FS_MAX_FILES;
+	uint16_t index = (old_size - 1) / EEPROM_FS_BLOCK_DATA_SIZE;
+	lba_t block = nth_block_of_file(fh, index);
 
-		_fs_debug1("Unlink successful.\n");
+	size_t new_size = in_place_end(fh);
+	if (fh->filesize < new_size)
+	{
+		new_size = fh->filesize;
 	}
-	else
+
+	size_t start = old_size - index * EEPROM_FS_BLOCK_DATA_SIZE;
+	block_crc_t crc = stored_data_crc(block, block_crc_seed(file, index), 0,
+			start);
+
+	block_crc_t stored[2];
+	read_eeprom((void*) stored, crc_pointer(block, 0), sizeof(stored));
+	if (stored[0] != crc && stored[1] != crc)
 	{
-		_fs_error("Cannot unlink invalid block %d.\n", block);
+		// Leave it failing, rather than cover the damage with a new CRC
+		_fs_error("Block %d of file %d is corrupt.\n", block, file);
+		return;
 	}
+
+	uint8_t copy = stored[0] == crc;
+	crc = stored_data_crc(block, crc, start,
+			new_size - index * EEPROM_FS_BLOCK_DATA_SIZE);
+	diff_write_block((void*) &crc, crc_pointer(block, copy),
+			sizeof(block_crc_t));
 }
 
 /**
- * Overwrite the next_block field of a given block without touching the data
+ * Check the data of every block of a file against its CRC. Only reports
+ * corrupt blocks: the data can't be recovered.
+ * The file's block chain must have been checked by fsck_file() first.
  *
- * \param block Address of block to modify
- * \param target Address of next block to link to
+ * \param file File to check
+ * \return Number of corrupt blocks
  */
-void relink(lba_t block, lba_t target)
+uint16_t fsck_file_data(fname_t file)
 {
-	if (block >= 0 && block < (lba_t) EEPROM_FS_NUM_BLOCKS)
+	uint16_t problems = 0;
+	size_t size = alloc_table[file].filesize;
+	lba_t block = alloc_table[file].data_block;
+
+	for (uint16_t n = 0; (size_t) n * EEPROM_FS_BLOCK_DATA_SIZE < size; n++)
 	{
-		if (target >= NULL_PTR && target < (lba_t) EEPROM_FS_NUM_BLOCKS)
+		size_t used = size - (size_t) n * EEPROM_FS_BLOCK_DATA_SIZE;
+		if (used > EEPROM_FS_BLOCK_DATA_SIZE)
 		{
-			_fs_debug3("Relinking block %d -> %d...", block, target);
-
-			// Write address only
-			eeprom_write_block((void*) &target, get_block_pointer(block),
-					sizeof(lba_t));
+			used = EEPROM_FS_BLOCK_DATA_SIZE;
+		}
 
-			_fs_debug3("Done.\n");
+		if (!block_intact(block, file, n, used, NULL))
+		{
+			_fs_error("Block %d of file %d is corrupt.\n", block, file);
+			problems++;
 		}
-		else
+
+		if ((size_t) (n + 1) * EEPROM_FS_BLOCK_DATA_SIZE < size)
 		{
-			_fs_error("Attempted to relink to invalid block %d.\n", target);
+			block = next_block_in_chain(block);
 		}
 	}
-	else
+
+	return problems;
+}
+
+/**
+ * Returns the EEPROM pointer to a copy of the CRC of a block
+ *
+ * \param block Logical block
+ * \param copy Which copy, 0 or 1
+ */
+void* crc_pointer(lba_t block, uint8_t copy)
+{
+	return get_block_pointer(block) + offsetof(block_t, crc)
+			+ copy * sizeof(block_crc_t);
+}
+#endif
+
+/**
+ * Write a block of memory to storage, only programming the bytes that differ
+ * from what is already stored.
+ *
+ * \param src Data to write
+ * \param dst Storage address to write to
+ * \param n Number of bytes to write
+ */
+void diff_write_block(const void* src, void* dst, size_t n)
+{
+#if EEPROM_FS_STATS
+	uint32_t start = fs_ticks();
+	backend->update(src, dst, n);
+	fs_stats.busy_ticks += fs_ticks() - start;
+#else
+	backend->update(src, dst, n);
+#endif
+}
+
+/**
+ * Write a block of memory to storage, programming every byte
+ *
+ * \param src Data to write
+ * \param dst Storage address to write to
+ * \param n Number of bytes to write
+ */
+void write_eeprom(const void* src, void* dst, size_t n)
+{
+#if EEPROM_FS_STATS
+	uint32_t start = fs_ticks();
+	backend->write(src, dst, n);
+	fs_stats.busy_ticks += fs_ticks() - start;
+#else
+	backend->write(src, dst, n);
+#endif
+}
+
+/**
+ * Read a block of memory from storage
+ *
+ * \param dst Buffer to read into
+ * \param src Storage address to read from
+ * \param n Number of bytes to read
+ */
+void read_eeprom(void* dst, const void* src, size_t n)
+{
+#if EEPROM_FS_STATS
+	uint32_t start = fs_ticks();
+	backend->read(dst, src, n);
+	fs_stats.busy_ticks += fs_ticks() - start;
+	fs_stats.bytes_read += n;
+#else
+	backend->read(dst, src, n);
+#endif
+}
+
+/**
+ * Set the storage backend used by the filesystem
+ *
+ * \param b Backend operations. Must stay valid while the filesystem is used.
+ */
+void set_backend(const fs_backend_t* b)
+{
+	backend = b;
+}
+
+/**
+ * Returns the number of bytes waiting to be written to storage
+ */
+uint8_t poll_eepromfs()
+{
+	if (backend->pending == NULL)
 	{
-		_fs_error("Attempted to write to invalid block %d.\n", block);
+		return 0;
+	}
+	return backend->pending();
+}
+
+/**
+ * Wait until every queued write has reached storage
+ */
+void flush_eepromfs()
+{
+	_fs_trace(TRACE_FLUSH, TRACE_NO_FILE, NULL_PTR);
+
+#if EEPROM_FS_STATS
+	uint32_t start = fs_ticks();
+	backend->sync();
+	fs_stats.busy_ticks += fs_ticks() - start;
+#else
+	backend->sync();
+#endif
+}
+
+/**
+ * Returns the counters of the diff-aware EEPROM writer
+ */
+fs_write_stats_t get_write_stats()
+{
+	fs_write_stats_t stats;
+#ifdef __AVR__
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#endif
+	{
+		stats = write_stats;
+	}
+	return stats;
+}
+
+/**
+ * Reset the counters of the diff-aware EEPROM writer
+ */
+void reset_write_stats()
+{
+#ifdef __AVR__
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#endif
+	{
+#if EEPROM_FS_STATS
+		// Keep what the filesystem's counters have counted so far
+		fs_stats.bytes_written += write_stats.bytes_written
+				- fs_stats_base.bytes_written + write_stats.bytes_write_only
+				- fs_stats_base.bytes_write_only;
+		fs_stats.bytes_skipped += write_stats.bytes_skipped
+				- fs_stats_base.bytes_skipped;
+		memset(&fs_stats_base, 0, sizeof(fs_write_stats_t));
+#endif
+		write_stats.bytes_written = 0;
+		write_stats.bytes_write_only = 0;
+		write_stats.bytes_skipped = 0;
+	}
+}
+
+#if EEPROM_FS_STATS || EEPROM_FS_TRACE
+/**
+ * Set the clock the stats and trace time operations by
+ *
+ * \param clock Function returning a free-running tick count, or NULL
+ */
+void set_fs_clock(uint32_t (*clock)(void))
+{
+	fs_clock = clock;
+}
+
+/**
+ * Returns the tick count of the clock, or 0 if there isn't one
+ */
+uint32_t fs_ticks()
+{
+	return fs_clock != NULL ? fs_clock() : 0;
+}
+#endif
+
+#if EEPROM_FS_STATS
+/**
+ * Get the counters of everything the filesystem has done
+ */
+fs_stats_t get_fs_stats()
+{
+	fs_stats_t stats = fs_stats;
+	fs_write_stats_t now = get_write_stats();
+	stats.bytes_written += (now.bytes_written - fs_stats_base.bytes_written)
+			+ (now.bytes_write_only - fs_stats_base.bytes_write_only);
+	stats.bytes_skipped += now.bytes_skipped - fs_stats_base.bytes_skipped;
+	return stats;
+}
+
+/**
+ * Reset the counters of everything the filesystem has done
+ */
+void reset_fs_stats()
+{
+	memset(&fs_stats, 0, sizeof(fs_stats_t));
+	fs_stats_base = get_write_stats();
+}
+
+#endif
+
+#if EEPROM_FS_TRACE
+/**
+ * Start tracing an operation
+ *
+ * \param op Operation
+ * \param file File operated on, or TRACE_NO_FILE
+ * \param block Block operated on, or NULL
+ * \return The operation's trace, for trace_end()
+ */
+trace_span_t trace_begin(fs_trace_op_t op, fname_t file, lba_t block)
+{
+	trace_span_t span;
+	span.start = fs_ticks();
+	span.entry.op = op | (trace_depth < TRACE_MAX_DEPTH ? trace_depth
+			: TRACE_MAX_DEPTH) << TRACE_DEPTH_SHIFT;
+	span.entry.file = file;
+	span.entry.block = block;
+	span.entry.start = (uint16_t) span.start;
+	span.entry.duration = 0;
+	trace_depth++;
+	return span;
+}
+
+/**
+ * Record a traced operation in the ring, once it has finished
+ *
+ * \param span The operation's trace
+ */
+void trace_end(trace_span_t* span)
+{
+	trace_depth--;
+
+	uint32_t elapsed = fs_ticks() - span->start;
+	span->entry.duration = elapsed > UINT16_MAX ? UINT16_MAX : elapsed;
+
+	trace_ring[trace_next] = span->entry;
+	trace_next = (trace_next + 1) & (EEPROM_FS_TRACE - 1);
+	if (trace_len < EEPROM_FS_TRACE)
+	{
+		trace_len++;
+	}
+}
+
+/**
+ * Copy the trace, oldest entry first
+ *
+ * \param entries Buffer to copy to
+ * \param max Number of entries the buffer holds
+ * \return Number of entries copied
+ */
+uint16_t get_trace(fs_trace_entry_t* entries, uint16_t max)
+{
+	uint16_t n = trace_len < max ? trace_len : max;
+	// Skip the oldest entries that don't fit
+	uint16_t i = (trace_next - n) & (EEPROM_FS_TRACE - 1);
+
+	for (uint16_t j = 0; j < n; j++)
+	{
+		entries[j] = trace_ring[i];
+		i = (i + 1) & (EEPROM_FS_TRACE - 1);
 	}
+
+	return n;
+}
+
+/**
+ * Empty the trace
+ */
+void reset_trace()
+{
+	// Leave trace_depth, for any operations under way
+	trace_next = 0;
+	trace_len = 0;
+}
+
+/**
+ * Print the trace, oldest entry first: a line per entry of its op, file,
+ * block, start and duration, in hex, between a header and an end line
+ */
+void dump_trace()
+{
+	_fs_printf("eeprom-fs trace %u\n", trace_len);
+
+	uint16_t i = (trace_next - trace_len) & (EEPROM_FS_TRACE - 1);
+	for (uint16_t j = 0; j < trace_len; j++)
+	{
+		fs_trace_entry_t* e = &trace_ring[i];
+		_fs_printf("T %02x %02x %04x %04x %04x\n", e->op, e->file,
+				(uint16_t) e->block, e->start, e->duration);
+		i = (i + 1) & (EEPROM_FS_TRACE - 1);
+	}
+
+	_fs_printf("end\n");
 }
+#endif
 
 void dump_eeprom()
 {
@@ -707,7 +3021,7 @@ void dump_eeprom()
 	for (uintptr_t i = 0; i < EEPROM_FS_SIZE; i++)
 	{
 		// Store pure value
-		val = eeprom_read_byte((uint8_t*) i);
+		read_eeprom((void*) &val, (void*) i, 1);
 
 		// Store printable ASCII character
 		if ((val < 0x20) || (val > 0x7e))
@@ -718,7 +3032,7 @@ void dump_eeprom()
 
 		// Print line offset
 		if (i % 16 == 0)
-			printf("\n%#05x : ", i);
+			printf("\n%#05x : ", (unsigned int) i);
 
 		// Print hex code
 		printf("%02x ", val);
@@ -735,9 +3049,10 @@ void dump_eeprom()
  */
 void wipe_eeprom()
 {
+	uint32_t zero = 0;
 	for (uintptr_t i = 0; i < EEPROM_FS_SIZE; i += sizeof(uint32_t))
 	{
-		eeprom_write_dword((uint32_t*) i, 0);
+		write_eeprom((void*) &zero, (void*) i, sizeof(uint32_t));
 	}
 }
 
@@ -747,57 +3062,49 @@ void wipe_eeprom()
  */
 void set_debug(uint8_t level)
 {
+#if EEPROM_FS_DEBUG_LEVEL
 	__debug = level;
+#else
+	(void) level;
+#endif
 }
 
-void _fs_error(const char *format, ...)
+/**
+ * Print a message to stderr
+ *
+ * \param format Format of the message, in flash on AVR
+ */
+void _fs_print(const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
+#ifdef __AVR__
+	vfprintf_P(stderr, format, args);
+#else
 	vfprintf(stderr, format, args);
+#endif
 	va_end(args);
 }
 
-void _fs_debug1(const char *format, ...)
-{
-	if (__debug >= 1)
-	{
-		va_list args;
-		va_start(args, format);
-		vfprintf(stderr, format, args);
-		va_end(args);
-	}
-}
-
-void _fs_debug2(const char *format, ...)
-{
-	if (__debug >= 2)
-	{
-		va_list args;
-		va_start(args, format);
-		vfprintf(stderr, format, args);
-		va_end(args);
-	}
-}
-
-void _fs_debug3(const char *format, ...)
-{
-	if (__debug >= 3)
-	{
-		va_list args;
-		va_start(args, format);
-		vfprintf(stderr, format, args);
-		va_end(args);
-	}
-}
-
-void _fs_debug4(const char *format, ...)
+#if EEPROM_FS_DEBUG_LEVEL
+/**
+ * Print a debug message to stderr, if the debug level is high enough
+ *
+ * \param level Level of the message
+ * \param format Format of the message, in flash on AVR
+ */
+void _fs_debug(uint8_t level, const char *format, ...)
 {
-	if (__debug >= 4)
+	if (__debug >= level)
 	{
 		va_list args;
 		va_start(args, format);
+#ifdef __AVR__
+		vfprintf_P(stderr, format, args);
+#else
 		vfprintf(stderr, format, args);
+#endif
 		va_end(args);
 	}
 }
+#endif
@@ -23,12 +23,16 @@
 
  The architecture is based off FAT with the file allocation located statically
  towards the start of the EEPROM memory. Because of this, the FAT table can be subject
- to wearing over several tens of thousands of file writes.
+ to wearing over several tens of thousands of file writes, unless its changes
+ are journaled (see EEPROM_FS_JOURNAL_SLOTS).
  */
 
 #ifndef EEPROM_FS_H_
 #define EEPROM_FS_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define EEPROM_FS_START 0x0
 #define EEPROM_FS_SIZE 2048
 #define EEPROM_FS_BLOCK_SIZE 32
@@ -36,11 +40,188 @@
 /* Prime number is recommended, but not mandatory */
 #define EEPROM_FS_MAX_FILES 29
 
+/*
+ * Keep a map of an open file's blocks in its file handle, so seeking and
+ * appending don't have to walk the block chain in EEPROM.
+ * Costs sizeof(lba_t) * EEPROM_FS_MAX_BLOCKS_PER_FILE bytes of RAM per handle.
+ */
+#ifndef EEPROM_FS_BLOCK_MAP
+#define EEPROM_FS_BLOCK_MAP 1
+#endif
+
+/*
+ * Internal EEPROM backend: program bytes that only clear bits (such as erased
+ * 0xFF cells) using the EEPROM's write-only mode, skipping the erase.
+ * Needs a part with EEPM bits.
+ */
+#ifndef EEPROM_FS_WRITE_ONLY
+#define EEPROM_FS_WRITE_ONLY 1
+#endif
+
+/*
+ * Internal EEPROM backend: queue writes and let the EE_READY interrupt write
+ * them in the background, instead of busy-waiting on each byte. Global
+ * interrupts must be enabled. The queue size must be a power of two, no
+ * larger than 128.
+ */
+#ifndef EEPROM_FS_ASYNC
+#define EEPROM_FS_ASYNC 0
+#endif
+#ifndef EEPROM_FS_ASYNC_QUEUE_SIZE
+#define EEPROM_FS_ASYNC_QUEUE_SIZE 32
+#endif
+
+/*
+ * Keep the allocation table as a checkpoint plus a journal of changes to it,
+ * written round a ring of this many slots (a power of two), instead of
+ * rewriting the table in place on every commit. Spreads the wear of the table over the slots, at a
+ * cost of 2 * sizeof(fs_checkpoint_t) + slots * sizeof(fs_journal_record_t)
+ * bytes of EEPROM. Each commit is a single record, so a power failure leaves
+ * either the old file or the new one. 0 keeps a static table, which is
+ * rewritten in place and can be left half updated by a power failure.
+ */
+#ifndef EEPROM_FS_JOURNAL_SLOTS
+#define EEPROM_FS_JOURNAL_SLOTS 8
+#endif
+#if EEPROM_FS_JOURNAL_SLOTS & (EEPROM_FS_JOURNAL_SLOTS - 1)
+#error "EEPROM_FS_JOURNAL_SLOTS must be a power of two"
+#endif
+
+/*
+ * Count how many times each block has been written, in the block's header,
+ * and allocate the least worn free block instead of the next one in the
+ * free block chain. Takes 2 bytes from the data of every block, and
+ * 2 * EEPROM_FS_NUM_BLOCKS bytes of RAM.
+ */
+#ifndef EEPROM_FS_WEAR_AWARE
+#define EEPROM_FS_WEAR_AWARE 0
+#endif
+/*
+ * Only pass over the first free block for one worn this many times less.
+ * Taking a block from the middle of the free block chain costs a relink.
+ */
+#ifndef EEPROM_FS_WEAR_THRESHOLD
+#define EEPROM_FS_WEAR_THRESHOLD 8
+#endif
+/*
+ * wear_level() moves a file when the most worn free block has been written
+ * this many times more than the least worn block in a file.
+ */
+#ifndef EEPROM_FS_STATIC_WEAR_THRESHOLD
+#define EEPROM_FS_STATIC_WEAR_THRESHOLD 64
+#endif
+
+/*
+ * Track free blocks in a bitmap in RAM, rebuilt from the files when
+ * mounting, instead of in a chain through the free blocks. Nothing is
+ * written to free a block, and free_space() doesn't have to walk a chain.
+ * Costs EEPROM_FS_NUM_BLOCKS / 8 bytes of RAM.
+ */
+#ifndef EEPROM_FS_FREE_BITMAP
+#define EEPROM_FS_FREE_BITMAP 0
+#endif
+
+/*
+ * Save the state init_eepromfs() would otherwise rebuild by walking block
+ * chains (the end of the free block chain, or the free bitmap) when
+ * unmount_eepromfs() is called, round a ring of this many slots (a power of
+ * two). After a clean unmount, mounting loads it instead. Needs the journal,
+ * and costs slots * sizeof(fs_mount_state_t) bytes of EEPROM. 0 disables.
+ */
+#ifndef EEPROM_FS_MOUNT_SLOTS
+#define EEPROM_FS_MOUNT_SLOTS 0
+#endif
+#if EEPROM_FS_MOUNT_SLOTS && !EEPROM_FS_JOURNAL_SLOTS
+#error "EEPROM_FS_MOUNT_SLOTS needs EEPROM_FS_JOURNAL_SLOTS"
+#endif
+#if EEPROM_FS_MOUNT_SLOTS & (EEPROM_FS_MOUNT_SLOTS - 1)
+#error "EEPROM_FS_MOUNT_SLOTS must be a power of two"
+#endif
+
+/*
+ * Run fsck_eepromfs(FSCK_QUICK) from init_eepromfs(), so a damaged chain is
+ * repaired, and blocks lost by a power failure are freed again, before the
+ * filesystem is used. Costs a walk of every file and of the free block
+ * chain at each mount, even when EEPROM_FS_MOUNT_SLOTS would skip it.
+ */
+#ifndef EEPROM_FS_MOUNT_FSCK
+#define EEPROM_FS_MOUNT_FSCK 0
+#endif
+
+/*
+ * Keep a CRC of each block's data in its header, checked whenever the block
+ * is read, so data corrupted in storage is reported rather than returned.
+ * The CRC is seeded with the file and the block's place in it, so a damaged
+ * link that leads a read into the wrong block is caught too. 8 for a CRC-8,
+ * which takes 2 bytes from the data of every block, or 16 for a CRC-16,
+ * which takes 4 and lets fewer errors through. Two copies are kept, so data
+ * appended in place can't invalidate the old CRC before it's committed.
+ * 0 disables.
+ */
+#ifndef EEPROM_FS_BLOCK_CRC
+#define EEPROM_FS_BLOCK_CRC 0
+#endif
+#if EEPROM_FS_BLOCK_CRC == 16
+#define EEPROM_FS_BLOCK_CRC_SIZE (2 * sizeof(uint16_t))
+#elif EEPROM_FS_BLOCK_CRC == 8
+#define EEPROM_FS_BLOCK_CRC_SIZE (2 * sizeof(uint8_t))
+#elif EEPROM_FS_BLOCK_CRC == 0
+#define EEPROM_FS_BLOCK_CRC_SIZE 0
+#else
+#error "EEPROM_FS_BLOCK_CRC must be 0, 8 or 16"
+#endif
+
+/*
+ * Highest debug message level compiled in, from 0 to 4. Messages above it
+ * compile to nothing, arguments and all; set_debug() picks which of the rest
+ * are printed. Errors are always printed. On AVR, message formats are kept
+ * in flash rather than SRAM.
+ */
+#ifndef EEPROM_FS_DEBUG_LEVEL
+#define EEPROM_FS_DEBUG_LEVEL 0
+#endif
+
+/*
+ * Count what the filesystem does, for get_fs_stats(): EEPROM bytes read,
+ * written and skipped, blocks allocated, links followed, calls to each
+ * operation, and with a clock from set_fs_clock(), the time spent in
+ * storage accesses. Costs sizeof(fs_stats_t) bytes of RAM. 0 compiles the
+ * counting out.
+ */
+#ifndef EEPROM_FS_STATS
+#define EEPROM_FS_STATS 0
+#endif
+
+/*
+ * Record every filesystem operation in a ring of this many entries in RAM
+ * (a power of two): what it was, its file and block, and when it started
+ * and how long it took by the clock from set_fs_clock(). dump_trace() prints
+ * the ring for host/trace-decode. Costs sizeof(fs_trace_entry_t) bytes of
+ * RAM per entry. 0 disables.
+ */
+#ifndef EEPROM_FS_TRACE
+#define EEPROM_FS_TRACE 0
+#endif
+#if EEPROM_FS_TRACE & (EEPROM_FS_TRACE - 1)
+#error "EEPROM_FS_TRACE must be a power of two"
+#endif
+
 #define EEPROM_FS_META_OFFSET 0
+#if EEPROM_FS_JOURNAL_SLOTS
+#define EEPROM_FS_CHECKPOINT_OFFSET sizeof(fs_meta_t)
+#define EEPROM_FS_JOURNAL_OFFSET (EEPROM_FS_CHECKPOINT_OFFSET + 2 * sizeof(fs_checkpoint_t))
+#define EEPROM_FS_MOUNT_OFFSET (EEPROM_FS_JOURNAL_OFFSET + EEPROM_FS_JOURNAL_SLOTS * sizeof(fs_journal_record_t))
+#define EEPROM_FS_DATA_OFFSET (EEPROM_FS_MOUNT_OFFSET + EEPROM_FS_MOUNT_SLOTS * sizeof(fs_mount_state_t))
+#else
 #define EEPROM_FS_ALLOC_TABLE_OFFSET sizeof(fs_meta_t)
-#define EEPROM_FS_DATA_OFFSET (EEPROM_FS_ALLOC_TABLE_OFFSET + sizeof(alloc_table))
+#define EEPROM_FS_DATA_OFFSET (EEPROM_FS_ALLOC_TABLE_OFFSET + (EEPROM_FS_MAX_FILES + 1) * sizeof(file_alloc_t))
+#endif
 #define EEPROM_FS_NUM_BLOCKS ((EEPROM_FS_SIZE - EEPROM_FS_DATA_OFFSET) / EEPROM_FS_BLOCK_SIZE)
-#define EEPROM_FS_BLOCK_DATA_SIZE (EEPROM_FS_BLOCK_SIZE - sizeof(lba_t))
+#if EEPROM_FS_WEAR_AWARE
+#define EEPROM_FS_BLOCK_DATA_SIZE (EEPROM_FS_BLOCK_SIZE - sizeof(lba_t) - sizeof(uint16_t) - EEPROM_FS_BLOCK_CRC_SIZE)
+#else
+#define EEPROM_FS_BLOCK_DATA_SIZE (EEPROM_FS_BLOCK_SIZE - sizeof(lba_t) - EEPROM_FS_BLOCK_CRC_SIZE)
+#endif
 
 /*
  * Logical block address type
@@ -57,30 +238,107 @@ typedef uint16_t fname_t;
  */
 typedef char fdata_t;
 
+#if EEPROM_FS_BLOCK_CRC == 16
+/*
+ * Block CRC type
+ */
+typedef uint16_t block_crc_t;
+#elif EEPROM_FS_BLOCK_CRC == 8
+typedef uint8_t block_crc_t;
+#endif
+
 /*
  * Structures for internal types
+ * Stored structures use fixed-width fields, so an image has the same layout
+ * on every target.
  */
 typedef struct block
 {
 	lba_t next_block;
+#if EEPROM_FS_WEAR_AWARE
+	// Number of times the block has been allocated and written
+	uint16_t wear;
+#endif
+#if EEPROM_FS_BLOCK_CRC
+	// CRC of the data in use, in either copy
+	block_crc_t crc[2];
+#endif
 	fdata_t data[EEPROM_FS_BLOCK_DATA_SIZE];
 } block_t;
 
 typedef struct file_alloc
 {
-	size_t filesize;
+	uint16_t filesize;
 	lba_t data_block;
 } file_alloc_t;
 
 typedef struct fs_meta
 {
-	size_t block_size;
-	uintptr_t start_address;
-	size_t fs_size;
+	uint16_t block_size;
+	uint16_t start_address;
+	uint16_t fs_size;
 	uint16_t max_files;
 	uint16_t max_blocks_per_file;
+	uint16_t journal_slots;
+	uint16_t block_data_size;
+	uint16_t free_bitmap;
+	uint16_t mount_slots;
+	uint16_t block_crc;
 } fs_meta_t;
 
+/*
+ * Stored records below end with their sequence number, which is written
+ * after the rest of the record. A record cut short by a power failure still
+ * holds its old sequence number, so it is never mistaken for the new one.
+ */
+
+/*
+ * Copy of the whole allocation table, as of journal record seq
+ */
+typedef struct fs_checkpoint
+{
+	uint8_t crc;
+	uint8_t reserved;
+	file_alloc_t table[EEPROM_FS_MAX_FILES + 1];
+	uint16_t seq;
+} fs_checkpoint_t;
+
+/*
+ * Change to one entry of the allocation table.
+ * Record seq is kept in journal slot seq % EEPROM_FS_JOURNAL_SLOTS.
+ */
+typedef struct fs_journal_record
+{
+	// Index of the changed entry
+	uint8_t file;
+	uint8_t crc;
+	file_alloc_t alloc;
+	lba_t free_block;
+	// First and last blocks of the chain the entry replaced, which are freed
+	// once the record is written
+	lba_t old_first;
+	lba_t old_last;
+	uint16_t seq;
+} fs_journal_record_t;
+
+/*
+ * Free space state saved by unmount_eepromfs(), valid while the journal is
+ * still at record seq.
+ * Kept in mount slot seq % EEPROM_FS_MOUNT_SLOTS.
+ */
+typedef struct fs_mount_state
+{
+	uint8_t crc;
+	uint8_t reserved;
+	lba_t last_free_block;
+#if EEPROM_FS_FREE_BITMAP
+	lba_t alloc_cursor;
+	// Sized for the most blocks that could fit, as the layout depends on it
+	uint8_t free_bitmap[(EEPROM_FS_SIZE / EEPROM_FS_BLOCK_SIZE + 7) / 8];
+#endif
+	uint16_t seq;
+} fs_mount_state_t;
+
 enum handle_type
 {
 	FH_READ, FH_WRITE, FH_APPEND
@@ -93,6 +351,22 @@ typedef struct file_handle
 	enum handle_type type;
 	lba_t first_block;
 	lba_t last_block;
+	// Read cursor, and the block it currently points into
+	size_t position;
+	lba_t position_block;
+#if EEPROM_FS_BLOCK_CRC
+	// Block whose data a handle opened for reading holds in its buffer,
+	// checked against the block's CRC, and its index in the file
+	lba_t checked_block;
+	uint16_t checked_index;
+#endif
+#if EEPROM_FS_BLOCK_MAP
+	// Blocks of the file, in chain order
+	lba_t blocks[EEPROM_FS_MAX_BLOCKS_PER_FILE];
+#endif
+	// Data for the block currently being written, or with
+	// EEPROM_FS_BLOCK_CRC, the block last read
+	fdata_t buffer[EEPROM_FS_BLOCK_DATA_SIZE];
 } file_handle_t;
 
 typedef enum format_type
@@ -100,8 +374,108 @@ typedef enum format_type
 	FORMAT_FULL, FORMAT_QUICK, FORMAT_WIPE
 } format_type_t;
 
+typedef enum fsck_type
+{
+	FSCK_QUICK, FSCK_FULL
+} fsck_type_t;
+
+typedef struct fs_write_stats
+{
+	// Bytes programmed with a full erase and write
+	uint32_t bytes_written;
+	// Bytes programmed without an erase
+	uint32_t bytes_write_only;
+	// Bytes left alone because they were unchanged
+	uint32_t bytes_skipped;
+} fs_write_stats_t;
+
+/*
+ * Operations recorded by EEPROM_FS_TRACE
+ */
+typedef enum fs_trace_op
+{
+	TRACE_INIT,
+	TRACE_UNMOUNT,
+	TRACE_FORMAT,
+	TRACE_FSCK,
+	TRACE_OPEN_WRITE,
+	TRACE_OPEN_APPEND,
+	TRACE_OPEN_READ,
+	TRACE_CLOSE,
+	TRACE_WRITE,
+	TRACE_READ,
+	TRACE_SEEK,
+	TRACE_DELETE,
+	TRACE_FREE_SPACE,
+	TRACE_WEAR_LEVEL,
+	TRACE_FLUSH,
+	TRACE_LINK,
+	TRACE_UNLINK,
+	TRACE_RELINK,
+	TRACE_NUM_OPS
+} fs_trace_op_t;
+
+// File of an operation that isn't on a file
+#define TRACE_NO_FILE 0xFF
+// Parts of fs_trace_entry_t.op
+#define TRACE_OP_MASK 0x1F
+#define TRACE_DEPTH_SHIFT 5
+#define TRACE_MAX_DEPTH 7
+
+/*
+ * Operation recorded by EEPROM_FS_TRACE, once it has finished
+ */
+typedef struct fs_trace_entry
+{
+	// An fs_trace_op_t in the low bits, and above TRACE_DEPTH_SHIFT, how
+	// many traced operations it was called within (up to TRACE_MAX_DEPTH)
+	uint8_t op;
+	// File operated on, or TRACE_NO_FILE
+	uint8_t file;
+	// Block operated on, or NULL
+	lba_t block;
+	// Clock ticks when the operation started, and how long it took, up to
+	// UINT16_MAX
+	uint16_t start;
+	uint16_t duration;
+} fs_trace_entry_t;
+
+#if EEPROM_FS_STATS
+typedef struct fs_stats
+{
+	// EEPROM bytes read, not counting the backend comparing what a write
+	// would change
+	uint32_t bytes_read;
+	// EEPROM bytes programmed, with or without an erase, formats included
+	uint32_t bytes_written;
+	// EEPROM bytes left alone by writes because they were unchanged
+	uint32_t bytes_skipped;
+	// Both are taken from the writer's counters (get_write_stats()), so with
+	// EEPROM_FS_ASYNC, a byte is only counted once the interrupt has written
+	// it: call flush_eepromfs() before get_fs_stats() to count all of them,
+	// and before reset_fs_stats() so none are left from earlier writes.
+	// Blocks allocated to files
+	uint32_t blocks_allocated;
+	// Links followed from a block to the next in its chain
+	uint32_t chain_hops;
+	// Calls to read(), pread() and read_chunk()
+	uint32_t reads;
+	// Calls to write() and write_chunk()
+	uint32_t writes;
+	uint32_t closes;
+	uint32_t deletes;
+	// Block chains freed
+	uint32_t unlinks;
+	// Links rewritten
+	uint32_t relinks;
+	// Clock ticks spent in storage accesses, waiting for the EEPROM included
+	uint32_t busy_ticks;
+} fs_stats_t;
+#endif
+
 /**
- * Set the debug level of the filesystem
+ * Set the debug level of the filesystem.
+ * Levels above EEPROM_FS_DEBUG_LEVEL aren't compiled in, so print nothing.
  */
 void set_debug(uint8_t level);
 
@@ -109,12 +483,30 @@ void set_debug(uint8_t level);
  * Initialise the EEPROM filesystem
  */
 void init_eepromfs();
+/**
+ * Finish using the EEPROM filesystem: wait for queued writes, and save the
+ * free space state so the next #init_eepromfs() can skip rebuilding it.
+ * Call with no files open for writing.
+ */
+void unmount_eepromfs();
 /**
  * Format the EEPROM for the filesystem - called by #init_eepromfs() if
  * not already formatted.
  */
 void format_eepromfs(format_type_t f);
 
+/**
+ * Check the filesystem and repair it. A file whose block chain is too short
+ * for its size, or runs into another chain, is cut short at that block; the
+ * free space is rebuilt to hold every block not in a file, and nothing else.
+ * FSCK_QUICK reads each block header at most once, so it's cheap enough to
+ * run at every boot. FSCK_FULL also checks both copies of the allocation
+ * table checkpoint, and with EEPROM_FS_BLOCK_CRC, the data of every file.
+ * A block whose data is corrupt can only be reported, not repaired.
+ * Returns the number of problems found.
+ */
+uint16_t fsck_eepromfs(fsck_type_t f);
+
 /**
  * Prepare a file for writing.
  * The file handle returned is given to read/write functions.
@@ -138,17 +530,114 @@ file_handle_t open_for_read(fname_t filename);
 void close(file_handle_t* fh);
 
 /**
- * Write data to a file handle
+ * Write data to a file handle.
+ * Equivalent to a single call to #write_chunk().
  */
 void write(file_handle_t* fh, const fdata_t* data, size_t size);
 /**
- * Read data from a file handle
+ * Write the next chunk of data to a file handle.
+ * Data is buffered one block at a time in the file handle, so a file can be
+ * written in pieces without holding all of it in RAM. Call #close() to write
+ * out the last block and commit the file.
+ */
+void write_chunk(file_handle_t* fh, const fdata_t* data, size_t size);
+/**
+ * Read data from a file handle.
+ * With EEPROM_FS_BLOCK_CRC, reading stops at a corrupt block, and an error
+ * is reported. #pread() and #read_chunk() then return a short count.
  */
 void read(file_handle_t* fh, fdata_t* buf);
+/**
+ * Read part of a file from a given offset.
+ * Does not move the read cursor.
+ * Returns the number of bytes read.
+ */
+size_t pread(file_handle_t* fh, size_t offset, fdata_t* buf, size_t size);
+/**
+ * Read the next part of a file from the read cursor, advancing the cursor.
+ * Returns the number of bytes read.
+ */
+size_t read_chunk(file_handle_t* fh, fdata_t* buf, size_t size);
+/**
+ * Move the read cursor of a file handle
+ */
+void seek(file_handle_t* fh, size_t offset);
 /**
  * Delete an entire file
  */
 void delete(fname_t filename);
+/**
+ * Returns the number of bytes of free space.
+ * Walks the free block chain unless EEPROM_FS_FREE_BITMAP is set.
+ */
+size_t free_space();
+
+#if EEPROM_FS_WEAR_AWARE
+/**
+ * Static wear levelling: move the file sitting on the least worn blocks
+ * onto the most worn free blocks, if the difference has grown too large,
+ * so its blocks can be reused. Call while the filesystem is idle.
+ * Returns 1 if a file was moved.
+ */
+uint8_t wear_level();
+#endif
+
+/**
+ * Returns the number of bytes still waiting to be written to storage.
+ * Always 0 unless the backend defers writes (e.g. EEPROM_FS_ASYNC).
+ */
+uint8_t poll_eepromfs();
+/**
+ * Wait until all queued writes have reached storage
+ */
+void flush_eepromfs();
+
+/**
+ * Get the counters of the diff-aware EEPROM writer
+ */
+fs_write_stats_t get_write_stats();
+/**
+ * Reset the counters of the diff-aware EEPROM writer
+ */
+void reset_write_stats();
+
+#if EEPROM_FS_STATS
+/**
+ * Get the counters of everything the filesystem has done since the last
+ * #reset_fs_stats()
+ */
+fs_stats_t get_fs_stats();
+/**
+ * Reset the filesystem's counters
+ */
+void reset_fs_stats();
+#endif
+
+#if EEPROM_FS_TRACE
+/**
+ * Copy the trace, oldest entry first.
+ * Returns the number of entries copied, at most max.
+ */
+uint16_t get_trace(fs_trace_entry_t* entries, uint16_t max);
+/**
+ * Empty the trace
+ */
+void reset_trace();
+/**
+ * Print the trace to stdout, oldest entry first, in the form
+ * host/trace-decode reads
+ */
+void dump_trace();
+#endif
+
+#if EEPROM_FS_STATS || EEPROM_FS_TRACE
+/**
+ * Set the clock that the stats and trace time operations by: a function
+ * returning a free-running tick count, such as a timer or millisecond
+ * count. NULL stops timing.
+ */
+void set_fs_clock(uint32_t (*clock)(void));
+#endif
 
 /**
  * Display all bytes stored in the EEPROM in a hex-dump format
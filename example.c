@@ -26,6 +26,8 @@
  to wearing over several tens of thousands of file writes.
  */
 
+#include <string.h>
+
 #include "debug.h"
 #include "eeprom-fs/eeprom-fs.h"
 
@@ -33,7 +35,9 @@ int main(void)
 {
 	// Initialise debug output.
 	init_debug_uart1();
-	// If you don't want spam, replace 2 with 0.
+	// If you don't want spam, replace 2 with 0. Debug messages are only
+	// compiled in up to EEPROM_FS_DEBUG_LEVEL, so build with
+	// -DEEPROM_FS_DEBUG_LEVEL=2 to see them.
 	set_debug(2);
 
 	// Initialise and format filesystem
@@ -77,6 +81,28 @@ int main(void)
 	read(&fh, lipsum_stored);
 	printf("--> %s", lipsum_stored);
 
+	printf("\n== Reading 5 bytes from offset 6 of file 7...\n");
+	fdata_t word[6] = { 0 };
+	pread(&fh, 6, word, 5);
+	printf("--> %s\n", word);
+
+	printf("\n== Writing file 8 one word at a time...\n");
+	fh = open_for_write(8);
+	const char* words[] = { "The ", "quick ", "brown ", "fox\n" };
+	for (int i = 0; i < 4; i++)
+	{
+		write_chunk(&fh, words[i], strlen(words[i]));
+	}
+	// Null-terminate the file
+	write_chunk(&fh, "", 1);
+	close(&fh);
+
+	printf("\n== Reading file 8...\n");
+	fh = open_for_read(8);
+	fdata_t fox_stored[fh.filesize];
+	read(&fh, fox_stored);
+	printf("--> %s", fox_stored);
+
 	printf("\n== Appending 'cake! ' to file 1337...\n");
 	fh = open_for_append(1337);
 	fdata_t cake[] = "cake! ";
@@ -98,6 +124,9 @@ int main(void)
 	printf("\n== Dumping EEPROM...\n");
 	dump_eeprom();
 
+	// Save state for a faster mount next time, before powering down
+	unmount_eepromfs();
+
 	for (;;)
 		;
 }
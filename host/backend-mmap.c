@@ -0,0 +1,335 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Host storage backend: an EEPROM image file mapped into memory.
+
+ Note that eeprom-fs defines read(), write(), close(), link() and unlink(),
+ so this file sticks to stdio and mmap rather than <unistd.h>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "backend-mmap.h"
+
+void mmap_read(void* dst, const void* src, size_t n);
+void mmap_write(const void* src, void* dst, size_t n);
+void mmap_update(const void* src, void* dst, size_t n);
+void mmap_sync(void);
+void mmap_program(uintptr_t addr, uint8_t value, uint8_t erase);
+void mmap_charge_reads(size_t n);
+
+#define MMAP_ERASED_VALUE 0xFF
+
+const fs_backend_t mmap_backend =
+{
+	mmap_read,
+	mmap_write,
+	mmap_update,
+	mmap_sync,
+	NULL,
+	MMAP_ERASED_VALUE
+};
+
+const mmap_timing_t avr_timing =
+{
+	12000000,
+	4,
+	3400,
+	1800
+};
+
+uint32_t mmap_wear[MMAP_IMAGE_SIZE];
+
+uint8_t* mmap_image = NULL;
+FILE* mmap_file = NULL;
+const mmap_timing_t* mmap_timing_model = &avr_timing;
+mmap_stats_t mmap_activity;
+
+// Power cut emulation
+void (*mmap_cut)(void) = NULL;
+uint32_t mmap_cut_after = 0;
+uint8_t mmap_cut_torn = 0;
+
+/**
+ * Map an image file as the EEPROM
+ *
+ * \param path Image file, created full of erased bytes if it doesn't exist,
+ * 			   and extended with erased bytes if it's too short.
+ * 			   NULL maps an anonymous, erased image.
+ * \return 0 on success, -1 on failure
+ */
+int mmap_backend_open(const char* path)
+{
+	if (path == NULL)
+	{
+		mmap_image = mmap(NULL, MMAP_IMAGE_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mmap_image == MAP_FAILED)
+		{
+			mmap_image = NULL;
+			return -1;
+		}
+
+		memset(mmap_image, MMAP_ERASED_VALUE, MMAP_IMAGE_SIZE);
+		return 0;
+	}
+
+	mmap_file = fopen(path, "r+b");
+	if (mmap_file == NULL)
+	{
+		// New image, starting erased
+		mmap_file = fopen(path, "w+b");
+		if (mmap_file == NULL)
+		{
+			return -1;
+		}
+	}
+
+	// Writes past the end of the file would be lost, and reads fault, so
+	// fill out a short image with erased bytes
+	struct stat st;
+	if (fstat(fileno(mmap_file), &st) != 0)
+	{
+		fclose(mmap_file);
+		mmap_file = NULL;
+		return -1;
+	}
+	if (st.st_size < MMAP_IMAGE_SIZE)
+	{
+		uint8_t erased[MMAP_IMAGE_SIZE];
+		size_t missing = MMAP_IMAGE_SIZE - st.st_size;
+		memset(erased, MMAP_ERASED_VALUE, missing);
+		if (fseek(mmap_file, 0, SEEK_END) != 0
+				|| fwrite(erased, 1, missing, mmap_file) != missing
+				|| fflush(mmap_file) != 0)
+		{
+			fclose(mmap_file);
+			mmap_file = NULL;
+			return -1;
+		}
+	}
+
+	mmap_image = mmap(NULL, MMAP_IMAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fileno(mmap_file), 0);
+	if (mmap_image == MAP_FAILED)
+	{
+		mmap_image = NULL;
+		fclose(mmap_file);
+		mmap_file = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Unmap the image, writing it back to its file
+ */
+void mmap_backend_close()
+{
+	if (mmap_image != NULL)
+	{
+		if (mmap_file != NULL)
+		{
+			msync(mmap_image, MMAP_IMAGE_SIZE, MS_SYNC);
+		}
+		munmap(mmap_image, MMAP_IMAGE_SIZE);
+		mmap_image = NULL;
+	}
+
+	if (mmap_file != NULL)
+	{
+		fclose(mmap_file);
+		mmap_file = NULL;
+	}
+}
+
+/**
+ * Returns the mapped image
+ */
+uint8_t* mmap_backend_image()
+{
+	return mmap_image;
+}
+
+/**
+ * Set the timing model used for emulated busy time
+ */
+void mmap_backend_set_timing(const mmap_timing_t* t)
+{
+	mmap_timing_model = t;
+}
+
+/**
+ * Returns the counters of emulated EEPROM activity
+ */
+mmap_stats_t mmap_backend_stats()
+{
+	return mmap_activity;
+}
+
+/**
+ * Reset the counters of emulated EEPROM activity and the wear counts
+ */
+void mmap_backend_reset_stats()
+{
+	memset(&mmap_activity, 0, sizeof(mmap_activity));
+	memset(mmap_wear, 0, sizeof(mmap_wear));
+}
+
+/**
+ * Cut the power part way through a run: once a number of bytes have been
+ * programmed, the next byte isn't, and a handler is called instead. The
+ * handler mustn't return into the filesystem (longjmp() out of it instead).
+ *
+ * \param bytes Number of bytes to program before the power is cut
+ * \param torn Leave the byte being programmed erased if it needed an
+ * 			   erase, as if the power failed between the erase and the write
+ * \param cut Handler called when the power is cut, or NULL to keep the power on
+ */
+void mmap_backend_set_power_cut(uint32_t bytes, uint8_t torn, void (*cut)(void))
+{
+	mmap_cut_after = bytes;
+	mmap_cut_torn = torn;
+	mmap_cut = cut;
+}
+
+/**
+ * Read a block of memory from the image
+ *
+ * \param dst Buffer to read into
+ * \param src Image address to read from
+ * \param n Number of bytes to read
+ */
+void mmap_read(void* dst, const void* src, size_t n)
+{
+	memcpy(dst, &mmap_image[(uintptr_t) src], n);
+
+	mmap_charge_reads(n);
+}
+
+/**
+ * Write a block of memory to the image, erasing and writing every byte
+ *
+ * \param src Data to write
+ * \param dst Image address to write to
+ * \param n Number of bytes to write
+ */
+void mmap_write(const void* src, void* dst, size_t n)
+{
+	const uint8_t* data = (const uint8_t*) src;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		mmap_program((uintptr_t) dst + i, data[i], 1);
+		mmap_activity.bytes_written++;
+		mmap_activity.busy_ns += mmap_timing_model->erase_write_us * 1000ULL;
+		write_stats.bytes_written++;
+	}
+}
+
+/**
+ * Write a block of memory to the image, only programming bytes that
+ * differ, and skipping the erase where the new value only clears bits
+ *
+ * \param src Data to write
+ * \param dst Image address to write to
+ * \param n Number of bytes to write
+ */
+void mmap_update(const void* src, void* dst, size_t n)
+{
+	const uint8_t* data = (const uint8_t*) src;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		uintptr_t addr = (uintptr_t) dst + i;
+		uint8_t old = mmap_image[addr];
+
+		// Each byte is read back to compare it
+		mmap_charge_reads(1);
+
+		if (old == data[i])
+		{
+			mmap_activity.bytes_skipped++;
+			write_stats.bytes_skipped++;
+		}
+		else if ((old & data[i]) == data[i])
+		{
+			mmap_program(addr, data[i], 0);
+			mmap_activity.bytes_write_only++;
+			mmap_activity.busy_ns += mmap_timing_model->write_only_us * 1000ULL;
+			write_stats.bytes_write_only++;
+		}
+		else
+		{
+			mmap_program(addr, data[i], 1);
+			mmap_activity.bytes_written++;
+			mmap_activity.busy_ns += mmap_timing_model->erase_write_us * 1000ULL;
+			write_stats.bytes_written++;
+		}
+	}
+}
+
+/**
+ * Writes to the image are never deferred
+ */
+void mmap_sync(void)
+{
+}
+
+/**
+ * Program one byte of the image, counting the wear on it
+ *
+ * \param addr Image address
+ * \param value Value to write
+ * \param erase 1 if the byte is erased before it is written
+ */
+void mmap_program(uintptr_t addr, uint8_t value, uint8_t erase)
+{
+	if (mmap_cut != NULL && mmap_cut_after-- == 0)
+	{
+		void (*cut)(void) = mmap_cut;
+		mmap_cut = NULL;
+		if (mmap_cut_torn && erase)
+		{
+			mmap_image[addr] = MMAP_ERASED_VALUE;
+		}
+		cut();
+	}
+
+	mmap_image[addr] = value;
+	mmap_wear[addr]++;
+}
+
+/**
+ * Count bytes read from the image, and the CPU time they would take
+ *
+ * \param n Number of bytes read
+ */
+void mmap_charge_reads(size_t n)
+{
+	mmap_activity.bytes_read += n;
+	mmap_activity.busy_ns += n * mmap_timing_model->read_cycles * 1000000000ULL
+			/ mmap_timing_model->cpu_hz;
+}
@@ -0,0 +1,117 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Host storage backend: an EEPROM image file mapped into memory.
+
+ Every access is also run through a timing model of the AVR's internal
+ EEPROM, so host runs report how long the same operations would keep a real
+ part busy, and how many times each byte has been programmed.
+ */
+
+#ifndef BACKEND_MMAP_H_
+#define BACKEND_MMAP_H_
+
+#include <stdint.h>
+
+#include "eeprom-fs-backend.h"
+
+/*
+ * Size of the mapped image
+ */
+#define MMAP_IMAGE_SIZE (EEPROM_FS_START + EEPROM_FS_SIZE)
+
+/*
+ * Timing model of the emulated EEPROM
+ */
+typedef struct mmap_timing
+{
+	// CPU clock, used to turn cycles into time
+	uint32_t cpu_hz;
+	// CPU cycles spent reading one byte, including the CPU halt
+	uint16_t read_cycles;
+	// Time to erase and write one byte
+	uint16_t erase_write_us;
+	// Time to write one byte without erasing it first
+	uint16_t write_only_us;
+} mmap_timing_t;
+
+/*
+ * Counters of emulated EEPROM activity
+ */
+typedef struct mmap_stats
+{
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t bytes_write_only;
+	uint64_t bytes_skipped;
+	// Emulated time the EEPROM has kept the CPU busy
+	uint64_t busy_ns;
+} mmap_stats_t;
+
+/*
+ * ATmega internal EEPROM at 12 MHz, from the datasheet
+ */
+extern const mmap_timing_t avr_timing;
+
+extern const fs_backend_t mmap_backend;
+
+/*
+ * Number of times each byte of the image has been programmed
+ */
+extern uint32_t mmap_wear[MMAP_IMAGE_SIZE];
+
+/**
+ * Map an image file as the EEPROM, creating it full of erased bytes if it
+ * doesn't exist, and filling it out with erased bytes if it's shorter than
+ * MMAP_IMAGE_SIZE. A NULL path maps an anonymous, erased image instead.
+ * Returns 0 on success.
+ */
+int mmap_backend_open(const char* path);
+/**
+ * Unmap the image, writing it back to its file
+ */
+void mmap_backend_close();
+/**
+ * Returns the mapped image
+ */
+uint8_t* mmap_backend_image();
+
+/**
+ * Set the timing model used for emulated busy time
+ */
+void mmap_backend_set_timing(const mmap_timing_t* timing);
+/**
+ * Get the counters of emulated EEPROM activity
+ */
+mmap_stats_t mmap_backend_stats();
+/**
+ * Reset the counters of emulated EEPROM activity and the wear counts
+ */
+void mmap_backend_reset_stats();
+
+/**
+ * Cut the power once a number of bytes have been programmed: the next byte
+ * isn't, and cut() is called instead. cut() mustn't return into the
+ * filesystem. With torn set, a byte that needed an erase is left erased.
+ * A NULL cut() keeps the power on.
+ */
+void mmap_backend_set_power_cut(uint32_t bytes, uint8_t torn, void (*cut)(void));
+
+#endif /* BACKEND_MMAP_H_ */
@@ -0,0 +1,303 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Benchmark suite, printing CSV to compare builds by: the cost of writing,
+ reading, appending to and deleting a file, for file sizes from 1 byte to
+ EEPROM_FS_MAX_BLOCKS_PER_FILE blocks, with other files filling different
+ amounts of the filesystem.
+
+ Usage: bench-suite [iterations [build]]
+ Prints a line per operation, size and fill level, with:
+ - build: the name given, or the options the suite was built with
+ - op, size (bytes), blocks: the operation and the file's size
+ - fill_pct: how much of the filesystem other files hold
+ - host_ops_per_sec: operations per second on this host
+ - busy_us: emulated time an operation keeps an AVR busy
+ - read_bytes, written_bytes, skipped_bytes: EEPROM bytes read, programmed
+   and left alone as unchanged, per operation
+ Only the operation itself is measured, not the setup for it, such as
+ writing the file to be deleted. Build with other options to compare them,
+ e.g. make bench-suite SUITE_FLAGS=-DEEPROM_FS_BLOCK_CRC=16
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "eeprom-fs.h"
+#include "backend-mmap.h"
+
+#define DATA_SIZE EEPROM_FS_BLOCK_DATA_SIZE
+#define MAX_SIZE (EEPROM_FS_MAX_BLOCKS_PER_FILE * EEPROM_FS_BLOCK_DATA_SIZE)
+
+// File operated on; the others fill the filesystem
+#define BENCH_FILE 0
+// Blocks left free for a rewrite of the largest file, which allocates its new
+// blocks before freeing the old ones
+#define SPARE_BLOCKS (2 * EEPROM_FS_MAX_BLOCKS_PER_FILE + 1)
+
+const uint8_t fill_levels[] = { 0, 25, 50, 75, 100 };
+
+fdata_t data[MAX_SIZE];
+
+/**
+ * Returns the host time in nanoseconds
+ */
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Change the data to write, so unchanged bytes don't make writes cheaper
+ */
+void change_data(uint32_t i)
+{
+	for (uint16_t n = 0; n < MAX_SIZE; n++)
+	{
+		data[n] = (fdata_t) ('a' + (n + i) % 26);
+	}
+}
+
+/**
+ * Write a file
+ */
+void write_file(fname_t file, size_t size)
+{
+	file_handle_t fh = open_for_write(file);
+	write(&fh, data, size);
+	close(&fh);
+}
+
+/**
+ * Size appended by the append operation: the second half of the file
+ */
+size_t append_size(size_t size)
+{
+	return size - size / 2;
+}
+
+/*
+ * Operations measured, each with the setup it needs first
+ */
+
+void setup_write(size_t size, uint32_t i)
+{
+	change_data(i);
+}
+
+void op_write(size_t size)
+{
+	write_file(BENCH_FILE, size);
+}
+
+void setup_read(size_t size, uint32_t i)
+{
+	if (i == 0)
+	{
+		write_file(BENCH_FILE, size);
+	}
+}
+
+void op_read(size_t size)
+{
+	fdata_t buf[MAX_SIZE];
+	file_handle_t fh = open_for_read(BENCH_FILE);
+	read(&fh, buf);
+	close(&fh);
+}
+
+void setup_append(size_t size, uint32_t i)
+{
+	change_data(i);
+	write_file(BENCH_FILE, size / 2);
+}
+
+void op_append(size_t size)
+{
+	file_handle_t fh = open_for_append(BENCH_FILE);
+	write(&fh, data, append_size(size));
+	close(&fh);
+}
+
+void setup_delete(size_t size, uint32_t i)
+{
+	change_data(i);
+	write_file(BENCH_FILE, size);
+}
+
+void op_delete(size_t size)
+{
+	delete(BENCH_FILE);
+}
+
+typedef struct bench_op
+{
+	const char* name;
+	void (*setup)(size_t size, uint32_t i);
+	void (*op)(size_t size);
+} bench_op_t;
+
+const bench_op_t ops[] =
+{
+	{ "write", setup_write, op_write },
+	{ "read", setup_read, op_read },
+	{ "append", setup_append, op_append },
+	{ "delete", setup_delete, op_delete }
+};
+
+/**
+ * Format the filesystem, and fill about the given share of its blocks with
+ * files other than BENCH_FILE, leaving room to rewrite the largest file
+ *
+ * \param percent Share of the blocks to fill
+ * \return Share of the blocks filled, in percent
+ */
+double fill(uint8_t percent)
+{
+	format_eepromfs(FORMAT_QUICK);
+
+	uint16_t target = (uint32_t) EEPROM_FS_NUM_BLOCKS * percent / 100;
+	if (target > EEPROM_FS_NUM_BLOCKS - SPARE_BLOCKS)
+	{
+		target = EEPROM_FS_NUM_BLOCKS - SPARE_BLOCKS;
+	}
+
+	uint16_t filled = 0;
+	change_data(0);
+	for (fname_t file = BENCH_FILE + 1;
+			file < EEPROM_FS_MAX_FILES && filled < target; file++)
+	{
+		uint16_t blocks = target - filled;
+		if (blocks > EEPROM_FS_MAX_BLOCKS_PER_FILE)
+		{
+			blocks = EEPROM_FS_MAX_BLOCKS_PER_FILE;
+		}
+		write_file(file, blocks * DATA_SIZE);
+		filled += blocks;
+	}
+
+	return 100.0 * filled / EEPROM_FS_NUM_BLOCKS;
+}
+
+/**
+ * Run an operation a number of times on a file of the given size, and print
+ * its average cost
+ */
+void bench(const char* build, const bench_op_t* op, size_t size,
+		double fill_pct, uint32_t iterations)
+{
+	uint64_t host_ns = 0;
+	mmap_stats_t total;
+	memset(&total, 0, sizeof(total));
+
+	for (uint32_t i = 0; i < iterations; i++)
+	{
+		op->setup(size, i);
+
+		mmap_backend_reset_stats();
+		uint64_t start = now_ns();
+		op->op(size);
+		host_ns += now_ns() - start;
+
+		mmap_stats_t stats = mmap_backend_stats();
+		total.bytes_read += stats.bytes_read;
+		total.bytes_written += stats.bytes_written + stats.bytes_write_only;
+		total.bytes_skipped += stats.bytes_skipped;
+		total.busy_ns += stats.busy_ns;
+	}
+
+	printf("%s,%s,%u,%u,%.1f,%u,%.0f,%.1f,%.1f,%.1f,%.1f\n", build, op->name,
+			(unsigned int) size,
+			(unsigned int) ((size + DATA_SIZE - 1) / DATA_SIZE), fill_pct,
+			iterations, host_ns > 0 ? iterations * 1e9 / host_ns : 0,
+			total.busy_ns / 1e3 / iterations,
+			(double) total.bytes_read / iterations,
+			(double) total.bytes_written / iterations,
+			(double) total.bytes_skipped / iterations);
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 200;
+	if (iterations == 0)
+	{
+		iterations = 1;
+	}
+
+	char options[96];
+	snprintf(options, sizeof(options),
+			"journal%d crc%d wear%d bitmap%d map%d block%d",
+			EEPROM_FS_JOURNAL_SLOTS, EEPROM_FS_BLOCK_CRC,
+			EEPROM_FS_WEAR_AWARE, EEPROM_FS_FREE_BITMAP, EEPROM_FS_BLOCK_MAP,
+			EEPROM_FS_BLOCK_SIZE);
+	const char* build = argc > 2 ? argv[2] : options;
+
+	if (mmap_backend_open(NULL) != 0)
+	{
+		fprintf(stderr, "Couldn't map an EEPROM image\n");
+		return 1;
+	}
+	set_backend(&mmap_backend);
+
+	init_eepromfs();
+
+	// 1 byte, part of a block, whole blocks, and just over a block
+	const size_t sizes[] =
+	{
+		1, DATA_SIZE / 2, DATA_SIZE, DATA_SIZE + 1, 2 * DATA_SIZE,
+		4 * DATA_SIZE, MAX_SIZE
+	};
+
+	printf("build,op,size,blocks,fill_pct,iterations,host_ops_per_sec,"
+			"busy_us,read_bytes,written_bytes,skipped_bytes\n");
+
+	double last_fill = -1;
+	for (uint8_t f = 0; f < sizeof(fill_levels); f++)
+	{
+		// The higher levels can all be limited to the same fill
+		double fill_pct = fill(fill_levels[f]);
+		if (fill_pct == last_fill)
+		{
+			continue;
+		}
+		last_fill = fill_pct;
+
+		for (uint8_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		{
+			// Sizes can coincide on small blocks
+			if (sizes[s] > MAX_SIZE || (s > 0 && sizes[s] <= sizes[s - 1]))
+			{
+				continue;
+			}
+
+			for (uint8_t o = 0; o < sizeof(ops) / sizeof(ops[0]); o++)
+			{
+				bench(build, &ops[o], sizes[s], fill_pct, iterations);
+			}
+		}
+	}
+
+	mmap_backend_close();
+	return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Benchmark of the basic file operations: reports the EEPROM traffic and
+ emulated busy time of each, along with the host time taken.
+
+ Usage: bench [iterations]
+ Build with -DEEPROM_FS_BLOCK_CRC=8 or 16 (make bench-crc8 bench-crc16) to
+ compare the cost of block CRCs. Built with EEPROM_FS_STATS, as the
+ Makefile does, it also reports the links followed and blocks allocated.
+
+ The chain rows walk an 8 block file to its end, as finding the last block
+ of a file does: "chain links" reads only each block's link, as
+ next_block_in_chain() does, and "chain blocks" reads each whole block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "eeprom-fs.h"
+#include "backend-mmap.h"
+
+#define BENCH_FILES 4
+#define FILE_SIZE 120
+#define APPEND_SIZE 10
+#define CHUNK_SIZE 8
+
+// File walked by the chain rows, after the others
+#define CHAIN_FILE BENCH_FILES
+#define CHAIN_BLOCKS (EEPROM_FS_MAX_BLOCKS_PER_FILE < 8 ? \
+		EEPROM_FS_MAX_BLOCKS_PER_FILE : 8)
+
+/*
+ * Filesystem internals, walked directly
+ */
+extern file_alloc_t alloc_table[EEPROM_FS_MAX_FILES + 1];
+void read_eeprom(void* dst, const void* src, size_t n);
+void* get_block_pointer(lba_t block);
+lba_t next_block_in_chain(lba_t block);
+
+fdata_t data[FILE_SIZE];
+
+/**
+ * Returns the host time in nanoseconds
+ */
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Change the data to write, so unchanged bytes don't make writes cheaper
+ */
+void change_data(uint32_t i)
+{
+	for (uint16_t n = 0; n < FILE_SIZE; n++)
+	{
+		data[n] = (fdata_t) ('a' + (n + i) % 26);
+	}
+}
+
+/**
+ * Write a whole file
+ */
+void op_write(uint32_t i)
+{
+	change_data(i);
+	file_handle_t fh = open_for_write(i % BENCH_FILES);
+	write(&fh, data, FILE_SIZE);
+	close(&fh);
+}
+
+/**
+ * Append to a file, starting it again once it's full
+ */
+void op_append(uint32_t i)
+{
+	fname_t file = i % BENCH_FILES;
+	if (open_for_read(file).filesize + APPEND_SIZE > FILE_SIZE)
+	{
+		delete(file);
+	}
+
+	change_data(i);
+	file_handle_t fh = open_for_append(file);
+	write(&fh, data, APPEND_SIZE);
+	close(&fh);
+}
+
+/**
+ * Read a whole file at once
+ */
+void op_read(uint32_t i)
+{
+	fdata_t buf[FILE_SIZE];
+	file_handle_t fh = open_for_read(i % BENCH_FILES);
+	read(&fh, buf);
+}
+
+/**
+ * Read a whole file in small pieces
+ */
+void op_read_chunks(uint32_t i)
+{
+	fdata_t buf[CHUNK_SIZE];
+	file_handle_t fh = open_for_read(i % BENCH_FILES);
+	while (read_chunk(&fh, buf, CHUNK_SIZE) > 0)
+	{
+	}
+}
+
+/**
+ * Walk a file's block chain, reading only the links
+ */
+void op_chain_links(uint32_t i)
+{
+	lba_t block = alloc_table[CHAIN_FILE].data_block;
+	for (uint8_t n = 0; n < CHAIN_BLOCKS; n++)
+	{
+		block = next_block_in_chain(block);
+	}
+}
+
+/**
+ * Walk a file's block chain, reading each whole block
+ */
+void op_chain_blocks(uint32_t i)
+{
+	block_t current_block;
+	lba_t block = alloc_table[CHAIN_FILE].data_block;
+	for (uint8_t n = 0; n < CHAIN_BLOCKS; n++)
+	{
+		read_eeprom((void*) &current_block, get_block_pointer(block),
+				EEPROM_FS_BLOCK_SIZE);
+		block = current_block.next_block;
+	}
+}
+
+/**
+ * Check the whole filesystem
+ */
+void op_fsck(uint32_t i)
+{
+	fsck_eepromfs(FSCK_FULL);
+}
+
+/**
+ * Run an operation a number of times, and print its average cost
+ */
+void bench(const char* name, void (*op)(uint32_t i), uint32_t iterations)
+{
+	mmap_backend_reset_stats();
+#if EEPROM_FS_STATS
+	reset_fs_stats();
+#endif
+	uint64_t start = now_ns();
+
+	for (uint32_t i = 0; i < iterations; i++)
+	{
+		op(i);
+	}
+
+	uint64_t host_ns = now_ns() - start;
+	mmap_stats_t stats = mmap_backend_stats();
+	printf("%-12s %10.1f %10.1f %10.1f %10.2f", name,
+			(double) stats.bytes_read / iterations,
+			(double) (stats.bytes_written + stats.bytes_write_only)
+					/ iterations, stats.busy_ns / 1e3 / iterations,
+			(double) host_ns / 1e3 / iterations);
+#if EEPROM_FS_STATS
+	fs_stats_t fs = get_fs_stats();
+	printf(" %8.2f %8.2f", (double) fs.chain_hops / iterations,
+			(double) fs.blocks_allocated / iterations);
+#endif
+	printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+	if (iterations == 0)
+	{
+		iterations = 1;
+	}
+
+	if (mmap_backend_open(NULL) != 0)
+	{
+		fprintf(stderr, "Couldn't map an EEPROM image\n");
+		return 1;
+	}
+	set_backend(&mmap_backend);
+
+	init_eepromfs();
+
+	printf("Block CRC: %d bits, %d of %d bytes of data per block (%.1f%%)\n",
+			EEPROM_FS_BLOCK_CRC, (int) EEPROM_FS_BLOCK_DATA_SIZE,
+			EEPROM_FS_BLOCK_SIZE,
+			100.0 * EEPROM_FS_BLOCK_DATA_SIZE / EEPROM_FS_BLOCK_SIZE);
+	printf("%d files of %d bytes, averages of %u operations\n\n",
+			BENCH_FILES, FILE_SIZE, iterations);
+	printf("%-12s %10s %10s %10s %10s", "operation", "read B", "written B",
+			"busy us", "host us");
+#if EEPROM_FS_STATS
+	printf(" %8s %8s", "hops", "allocs");
+#endif
+	printf("\n");
+
+	bench("write", op_write, iterations);
+	bench("read", op_read, iterations);
+	bench("read_chunk", op_read_chunks, iterations);
+	bench("fsck full", op_fsck, iterations);
+	bench("append", op_append, iterations);
+
+	fdata_t chain_data[CHAIN_BLOCKS * EEPROM_FS_BLOCK_DATA_SIZE];
+	memset(chain_data, 'c', sizeof(chain_data));
+	file_handle_t fh = open_for_write(CHAIN_FILE);
+	write(&fh, chain_data, sizeof(chain_data));
+	close(&fh);
+	printf("\nWalking a chain of %d blocks\n", CHAIN_BLOCKS);
+	bench("chain links", op_chain_links, iterations);
+	bench("chain blocks", op_chain_blocks, iterations);
+
+	mmap_backend_close();
+	return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Host version of example.c, running on an EEPROM image file.
+
+ Usage: example-host [image]
+ The image defaults to eeprom.img and is created if it doesn't exist.
+ Built with EEPROM_FS_TRACE (make example-trace), it prints the trace at the
+ end, timed in 10us ticks of emulated busy time, for host/trace-decode.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "eeprom-fs.h"
+#include "backend-mmap.h"
+
+/**
+ * Print the emulated EEPROM time taken since the last call
+ */
+// Busy time of the reports so far
+uint64_t busy_ns = 0;
+
+void report(const char* op)
+{
+	mmap_stats_t stats = mmap_backend_stats();
+	busy_ns += stats.busy_ns;
+	printf("    [%s: %llu bytes read, %llu written, %llu skipped, %.1f ms busy]\n",
+			op, (unsigned long long) stats.bytes_read,
+			(unsigned long long) (stats.bytes_written + stats.bytes_write_only),
+			(unsigned long long) stats.bytes_skipped, stats.busy_ns / 1e6);
+	mmap_backend_reset_stats();
+}
+
+#if EEPROM_FS_TRACE
+/**
+ * Clock for the trace: emulated busy time, in 10us ticks
+ */
+uint32_t busy_ticks()
+{
+	return (busy_ns + mmap_backend_stats().busy_ns) / 10000;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+	const char* path = argc > 1 ? argv[1] : "eeprom.img";
+	if (mmap_backend_open(path) != 0)
+	{
+		fprintf(stderr, "Couldn't map EEPROM image %s\n", path);
+		return 1;
+	}
+	set_backend(&mmap_backend);
+#if EEPROM_FS_TRACE
+	set_fs_clock(busy_ticks);
+#endif
+
+	// Initialise and format filesystem
+	init_eepromfs();
+	report("init");
+
+	printf("== Writing 'Hello World!' to file 6...\n");
+	file_handle_t fh = open_for_write(6);
+	fdata_t contents[] = "Hello World!\n\0";
+	write(&fh, contents, sizeof(contents));
+	close(&fh);
+	report("write");
+
+	printf("== Reading file 6...\n");
+	fh = open_for_read(6);
+	fdata_t stored_contents[fh.filesize];
+	read(&fh, stored_contents);
+	printf("--> %s", stored_contents);
+	report("read");
+
+	printf("== Deleting file 6...\n");
+	delete(6);
+	report("delete");
+
+	printf("== Reading non-existent file 6...\n");
+	fh = open_for_read(6);
+	read(&fh, stored_contents);
+	report("read");
+
+	printf("== Writing 'Lorem ipsum ' to file 7...\n");
+	fh = open_for_write(7);
+	fdata_t lipsum[] = "Lorem ipsum ";
+	write(&fh, lipsum, sizeof(lipsum));
+	close(&fh);
+	report("write");
+
+	printf("== Appending 'dolor sit amet...' to file 7...\n");
+	fh = open_for_append(7);
+	fdata_t lipsum_more[] =
+			"dolor sit amet, consectetur adipisicing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.\n\0";
+	write(&fh, lipsum_more, sizeof(lipsum_more));
+	close(&fh);
+	report("append");
+
+	printf("== Reading file 7...\n");
+	fh = open_for_read(7);
+	fdata_t lipsum_stored[fh.filesize];
+	read(&fh, lipsum_stored);
+	// As in example.c, the null written after 'Lorem ipsum ' ends the string
+	printf("--> %s\n", lipsum_stored);
+	report("read");
+
+	printf("== Reading 5 bytes from offset 6 of file 7...\n");
+	fdata_t word[6] = { 0 };
+	pread(&fh, 6, word, 5);
+	printf("--> %s\n", word);
+	report("pread");
+
+	printf("== Writing file 8 one word at a time...\n");
+	fh = open_for_write(8);
+	const char* words[] = { "The ", "quick ", "brown ", "fox\n" };
+	for (int i = 0; i < 4; i++)
+	{
+		write_chunk(&fh, words[i], strlen(words[i]));
+	}
+	// Null-terminate the file
+	write_chunk(&fh, "", 1);
+	close(&fh);
+	report("write_chunk");
+
+	printf("== Reading file 8...\n");
+	fh = open_for_read(8);
+	fdata_t fox_stored[fh.filesize];
+	read(&fh, fox_stored);
+	printf("--> %s", fox_stored);
+	report("read");
+
+	printf("== Appending 'cake! ' to file 1337...\n");
+	fh = open_for_append(1337);
+	fdata_t cake[] = "cake! ";
+	write(&fh, cake, sizeof(cake));
+	close(&fh);
+	report("append");
+
+	printf("== Reading file 1337...\n");
+	fh = open_for_read(1337);
+	fdata_t cake_stored[fh.filesize];
+	read(&fh, cake_stored);
+	// Cake isn't null-terminated, so print char by char instead
+	printf("--> ");
+	for (int i = 0; i < fh.filesize; i++)
+	{
+		printf("%c", cake_stored[i]);
+	}
+	printf("\n");
+	report("read");
+
+	printf("== Dumping EEPROM...\n");
+	dump_eeprom();
+	printf("\n");
+	report("dump");
+
+	unmount_eepromfs();
+	report("unmount");
+
+#if EEPROM_FS_TRACE
+	dump_trace();
+#endif
+
+	mmap_backend_close();
+	return 0;
+}
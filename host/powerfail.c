@@ -0,0 +1,874 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Power failure test: runs a workload of writes, appends, deletes and
+ formats on an emulated EEPROM, cutting the power at each byte the workload
+ programs in turn. After each cut, the filesystem is mounted again and
+ checked:
+ - the files hold what they held before the interrupted operation, or what
+   the operation was changing them to, so every earlier operation has stuck
+ - no block is in two files, or in a file and the free space
+ - the free space is intact and can still be written to
+ Blocks left neither in a file nor free are counted as lost.
+
+ Every cut is tried twice: once with the byte being programmed left as it
+ was, and once with it left erased, as if the power failed between the
+ erase and the write. Each workload starts on an erased EEPROM, so the
+ format done by the first init_eepromfs() is cut too. The cuts are shared
+ out between worker processes, one per CPU by default.
+
+ Workloads:
+ - example: the writes, delete, appends and unmount in example.c, step for
+   step, including its write a word at a time and its append to a new file
+ - mixed: every way a file is committed, including a rewrite that takes all
+   the free blocks, and enough commits to compact the journal
+ - format: files written either side of quick and full formats
+
+ Usage: powerfail [workload [workers [step]]]
+ Runs every workload by default. Cuts the power at every step-th byte
+ (every byte by default). Build with -DEEPROM_FS_JOURNAL_SLOTS=0 or other
+ options to test another configuration.
+ */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "eeprom-fs.h"
+#include "backend-mmap.h"
+#include "workers.h"
+
+#define NULL_PTR -1
+
+#define DATA_SIZE EEPROM_FS_BLOCK_DATA_SIZE
+#define MAX_SIZE (EEPROM_FS_MAX_BLOCKS_PER_FILE * EEPROM_FS_BLOCK_DATA_SIZE)
+
+#define WORKLOAD_FILES 12
+#define MAX_OPS 64
+// File written to check the free space after each cut
+#define SPARE_FILE (EEPROM_FS_MAX_FILES - 1)
+// Failed cuts to describe before only counting them
+#define MAX_REPORTS 10
+// Seconds a worker may spend on one cut before it's taken to have hung
+#define CUT_TIMEOUT 10
+
+/*
+ * Filesystem internals, checked directly
+ */
+extern file_alloc_t alloc_table[EEPROM_FS_MAX_FILES + 1];
+extern lba_t* const next_free_block;
+extern lba_t last_free_block;
+#if EEPROM_FS_FREE_BITMAP
+extern uint8_t free_bitmap[];
+extern uint16_t num_free_blocks;
+#endif
+lba_t next_block_in_chain(lba_t block);
+
+enum op_type
+{
+	OP_MOUNT, OP_WRITE, OP_APPEND, OP_DELETE, OP_UNMOUNT, OP_FORMAT
+};
+
+typedef struct op
+{
+	enum op_type type;
+	fname_t file;
+	uint16_t size;
+	// Data written, or NULL to write a pattern
+	const fdata_t* data;
+	// Sizes of the write_chunk() calls a write is made in, ending in 0, or
+	// NULL to write it with one write()
+	const uint8_t* chunks;
+	format_type_t format;
+} op_t;
+
+typedef struct workload
+{
+	const char* name;
+	void (*build)();
+} workload_t;
+
+/*
+ * What a worker found after one power cut. Results start zeroed, so cuts a
+ * worker never finished are left as CUT_NOT_RUN.
+ */
+enum cut_status
+{
+	CUT_NOT_RUN, CUT_OK, CUT_LOST, CUT_BAD
+};
+
+typedef struct cut_result
+{
+	uint8_t status;
+	// Operation running when the power was cut
+	uint16_t op;
+	uint16_t lost;
+	char problem[72];
+} cut_result_t;
+
+/*
+ * The workload, and the contents of every file before each operation
+ */
+op_t ops[MAX_OPS];
+unsigned int num_ops = 0;
+uint16_t sizes[MAX_OPS + 1][WORKLOAD_FILES];
+fdata_t contents[MAX_OPS + 1][WORKLOAD_FILES][MAX_SIZE];
+
+/*
+ * The sweep being run, and its results, shared with the workers
+ */
+unsigned long sweep_step;
+unsigned long sweep_cuts;
+cut_result_t* results;
+
+// Operation running when the power was cut
+unsigned int current_op;
+jmp_buf power_cut;
+
+/**
+ * Data written by an operation
+ */
+fdata_t op_data(unsigned int op, size_t i)
+{
+	return (fdata_t) (op * 37 + i * 11 + 1);
+}
+
+/**
+ * Number of blocks the files hold after the last operation added
+ */
+uint16_t used_blocks()
+{
+	uint16_t used = 0;
+	for (fname_t f = 0; f < WORKLOAD_FILES; f++)
+	{
+		used += (sizes[num_ops][f] + DATA_SIZE - 1) / DATA_SIZE;
+	}
+	return used;
+}
+
+/**
+ * Add an operation to the workload, working out what the files hold after it
+ *
+ * \param data Data to write, or NULL to write a pattern
+ */
+void add_data_op(enum op_type type, fname_t file, uint16_t size,
+		const fdata_t* data)
+{
+	unsigned int k = num_ops;
+	// The filesystem wraps filenames, and the workload runs them unwrapped
+	fname_t f = file % EEPROM_FS_MAX_FILES;
+	uint16_t offset = type == OP_APPEND ? sizes[k][f] : 0;
+	if (offset + size > MAX_SIZE)
+	{
+		size = MAX_SIZE - offset;
+	}
+
+	ops[k].type = type;
+	ops[k].file = file;
+	ops[k].size = size;
+	ops[k].data = data;
+	ops[k].chunks = NULL;
+
+	memcpy(sizes[k + 1], sizes[k], sizeof(sizes[k]));
+	memcpy(contents[k + 1], contents[k], sizeof(contents[k]));
+
+	switch (type)
+	{
+	case OP_WRITE:
+	case OP_APPEND:
+		for (uint16_t i = 0; i < size; i++)
+		{
+			contents[k + 1][f][offset + i] = data ? data[i] : op_data(k, i);
+		}
+		sizes[k + 1][f] = offset + size;
+		break;
+	case OP_DELETE:
+		sizes[k + 1][f] = 0;
+		break;
+	case OP_FORMAT:
+		memset(sizes[k + 1], 0, sizeof(sizes[k + 1]));
+		break;
+	default:
+		break;
+	}
+
+	num_ops++;
+}
+
+/**
+ * Add an operation writing a pattern, or changing no data, to the workload
+ */
+void add_op(enum op_type type, fname_t file, uint16_t size)
+{
+	add_data_op(type, file, size, NULL);
+}
+
+/**
+ * Add a write made in several write_chunk() calls to the workload
+ *
+ * \param chunks Sizes of the calls, ending in 0
+ */
+void add_chunked_op(fname_t file, const fdata_t* data, const uint8_t* chunks)
+{
+	uint16_t size = 0;
+	for (const uint8_t* c = chunks; *c > 0; c++)
+	{
+		size += *c;
+	}
+	add_data_op(OP_WRITE, file, size, data);
+	ops[num_ops - 1].chunks = chunks;
+}
+
+/**
+ * Add a format to the workload
+ */
+void add_format(format_type_t f)
+{
+	ops[num_ops].format = f;
+	add_op(OP_FORMAT, 0, 0);
+}
+
+/**
+ * The operations in example.c that program the EEPROM, with the same data
+ */
+void build_example()
+{
+	static const fdata_t hello[] = "Hello World!\n\0";
+	static const fdata_t lipsum[] = "Lorem ipsum ";
+	static const fdata_t lipsum_more[] =
+			"dolor sit amet, consectetur adipisicing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.\n\0";
+	// "The ", "quick ", "brown ", "fox\n" and the terminating null
+	static const fdata_t fox[] = "The quick brown fox\n";
+	static const uint8_t fox_chunks[] = { 4, 6, 6, 4, 1, 0 };
+	static const fdata_t cake[] = "cake! ";
+
+	add_op(OP_MOUNT, 0, 0);
+	add_data_op(OP_WRITE, 6, sizeof(hello), hello);
+	add_op(OP_DELETE, 6, 0);
+	add_data_op(OP_WRITE, 7, sizeof(lipsum), lipsum);
+	add_data_op(OP_APPEND, 7, sizeof(lipsum_more), lipsum_more);
+	add_chunked_op(8, fox, fox_chunks);
+	add_data_op(OP_APPEND, 1337, sizeof(cake), cake);
+	add_op(OP_UNMOUNT, 0, 0);
+}
+
+/**
+ * A workload that covers each way a file is committed: new files,
+ * rewrites, appends in place and onto new blocks, deletes, and a rewrite
+ * that takes every free block. There are enough commits to compact the
+ * journal.
+ */
+void build_mixed()
+{
+	add_op(OP_MOUNT, 0, 0);
+	add_op(OP_WRITE, 0, 10);
+	add_op(OP_APPEND, 0, 5);
+	add_op(OP_APPEND, 0, 2 * DATA_SIZE);
+	add_op(OP_WRITE, 1, 3 * DATA_SIZE + 7);
+	add_op(OP_WRITE, 0, DATA_SIZE + 1);
+	add_op(OP_DELETE, 1, 0);
+	add_op(OP_WRITE, 2, 1);
+	add_op(OP_APPEND, 2, MAX_SIZE - 1);
+	add_op(OP_WRITE, 2, 0);
+
+	// Fill the filesystem until one more file fits
+	fname_t f = 3;
+	while (EEPROM_FS_NUM_BLOCKS - used_blocks()
+			> EEPROM_FS_MAX_BLOCKS_PER_FILE + 1 && f < WORKLOAD_FILES - 1)
+	{
+		add_op(OP_WRITE, f++, MAX_SIZE);
+	}
+
+	// Rewrite a one block file onto every other free block, so the old
+	// block becomes the whole of the free block chain
+	uint16_t free_blocks = EEPROM_FS_NUM_BLOCKS - used_blocks();
+	if (free_blocks > EEPROM_FS_MAX_BLOCKS_PER_FILE + 1)
+	{
+		free_blocks = EEPROM_FS_MAX_BLOCKS_PER_FILE + 1;
+	}
+	add_op(OP_WRITE, f, 1);
+	add_op(OP_WRITE, f, (free_blocks - 1) * DATA_SIZE);
+	add_op(OP_DELETE, 3, 0);
+	add_op(OP_DELETE, 4, 0);
+	if (sizes[num_ops][f] + DATA_SIZE / 2 <= MAX_SIZE)
+	{
+		add_op(OP_APPEND, f, DATA_SIZE / 2);
+	}
+	add_op(OP_WRITE, 0, MAX_SIZE);
+	add_op(OP_DELETE, f, 0);
+}
+
+/**
+ * Files written either side of a quick and a full format
+ */
+void build_format()
+{
+	add_op(OP_MOUNT, 0, 0);
+	add_op(OP_WRITE, 0, 3 * DATA_SIZE);
+	add_op(OP_WRITE, 1, MAX_SIZE);
+	add_op(OP_DELETE, 0, 0);
+	add_format(FORMAT_QUICK);
+	add_op(OP_WRITE, 2, DATA_SIZE + 1);
+	add_format(FORMAT_FULL);
+	add_op(OP_WRITE, 1, 2 * DATA_SIZE);
+}
+
+const workload_t workloads[] =
+{
+	{ "example", build_example },
+	{ "mixed", build_mixed },
+	{ "format", build_format }
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+/**
+ * Run one operation of the workload
+ */
+void run_op(unsigned int k)
+{
+	fdata_t data[MAX_SIZE];
+	for (uint16_t i = 0; i < ops[k].size; i++)
+	{
+		data[i] = ops[k].data ? ops[k].data[i] : op_data(k, i);
+	}
+
+	file_handle_t fh;
+	switch (ops[k].type)
+	{
+	case OP_MOUNT:
+		init_eepromfs();
+		break;
+	case OP_WRITE:
+		fh = open_for_write(ops[k].file);
+		if (ops[k].chunks)
+		{
+			const fdata_t* chunk = data;
+			for (const uint8_t* c = ops[k].chunks; *c > 0; chunk += *c++)
+			{
+				write_chunk(&fh, chunk, *c);
+			}
+		}
+		else
+		{
+			write(&fh, data, ops[k].size);
+		}
+		close(&fh);
+		break;
+	case OP_APPEND:
+		fh = open_for_append(ops[k].file);
+		write(&fh, data, ops[k].size);
+		close(&fh);
+		break;
+	case OP_DELETE:
+		delete(ops[k].file);
+		break;
+	case OP_UNMOUNT:
+		unmount_eepromfs();
+		break;
+	case OP_FORMAT:
+		format_eepromfs(ops[k].format);
+		break;
+	}
+}
+
+/**
+ * Power cut handler: abandon the workload
+ */
+void cut(void)
+{
+	longjmp(power_cut, 1);
+}
+
+/**
+ * Check that a file holds what it should before or after an operation
+ *
+ * \return 1 if it does, 0 if not
+ */
+int file_matches(fname_t f, unsigned int k)
+{
+	uint16_t size = alloc_table[f].filesize;
+	if (alloc_table[f].data_block == NULL_PTR)
+	{
+		return sizes[k][f] == 0;
+	}
+	if (size != sizes[k][f] || size > MAX_SIZE)
+	{
+		return 0;
+	}
+
+	fdata_t buf[MAX_SIZE];
+	file_handle_t fh = open_for_read(f);
+	read(&fh, buf);
+	return memcmp(buf, contents[k][f], size) == 0;
+}
+
+/**
+ * Find a file that doesn't hold what it should before an operation
+ *
+ * \return The first such file, or -1 if every file does
+ */
+int file_mismatch(unsigned int k)
+{
+	for (fname_t f = 0; f < WORKLOAD_FILES; f++)
+	{
+		if (!file_matches(f, k))
+		{
+			return f;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Check the files against the workload, around the operation that was cut:
+ * either none of it has stuck, or all of it has. Once the whole workload has
+ * run, k is num_ops.
+ *
+ * \return Problem found, or NULL
+ */
+const char* check_files(unsigned int k, char* buf, size_t size)
+{
+	int old_mismatch = file_mismatch(k);
+	if (old_mismatch < 0)
+	{
+		return NULL;
+	}
+	if (k == num_ops)
+	{
+		snprintf(buf, size, "file %d doesn't hold its data", old_mismatch);
+		return buf;
+	}
+
+	int new_mismatch = file_mismatch(k + 1);
+	if (new_mismatch < 0)
+	{
+		return NULL;
+	}
+
+	for (fname_t f = 0; f < WORKLOAD_FILES; f++)
+	{
+		if (!file_matches(f, k) && !file_matches(f, k + 1))
+		{
+			snprintf(buf, size, "file %d holds neither its old nor new data", f);
+			return buf;
+		}
+	}
+	snprintf(buf, size, "file %d holds its new data, but file %d its old",
+			old_mismatch, new_mismatch);
+	return buf;
+}
+
+/**
+ * Check that every block is in at most one file or the free space, and that
+ * the free space is intact
+ *
+ * \param lost Set to the number of blocks in neither
+ * \return Problem found, or NULL
+ */
+const char* check_blocks(uint16_t* lost, char* buf, size_t size)
+{
+	// 0 for unused blocks, 1 for free blocks, or the file number + 2
+	uint8_t owner[EEPROM_FS_NUM_BLOCKS];
+	memset(owner, 0, sizeof(owner));
+	uint16_t num_owned = 0;
+
+	for (fname_t f = 0; f < EEPROM_FS_MAX_FILES; f++)
+	{
+		uint16_t num_blocks = (alloc_table[f].filesize + DATA_SIZE - 1)
+				/ DATA_SIZE;
+		lba_t block = alloc_table[f].data_block;
+		for (uint16_t n = 0; n < num_blocks; n++)
+		{
+			if (block < 0 || block >= (lba_t) EEPROM_FS_NUM_BLOCKS)
+			{
+				snprintf(buf, size, "file %d runs off the filesystem", f);
+				return buf;
+			}
+			if (owner[block])
+			{
+				snprintf(buf, size, "block %d is in file %d and file %d", block,
+						owner[block] - 2, f);
+				return buf;
+			}
+			owner[block] = f + 2;
+			num_owned++;
+			block = next_block_in_chain(block);
+		}
+	}
+
+	uint16_t num_free = 0;
+#if EEPROM_FS_FREE_BITMAP
+	for (lba_t i = 0; i < (lba_t) EEPROM_FS_NUM_BLOCKS; i++)
+	{
+		if (!((free_bitmap[i / 8] >> (i % 8)) & 1))
+		{
+			continue;
+		}
+		if (owner[i])
+		{
+			snprintf(buf, size, "free block %d is in file %d", i, owner[i] - 2);
+			return buf;
+		}
+		owner[i] = 1;
+		num_free++;
+	}
+	if (num_free != num_free_blocks)
+	{
+		snprintf(buf, size, "%d free blocks counted as %d", num_free,
+				num_free_blocks);
+		return buf;
+	}
+#else
+	lba_t block = *next_free_block;
+	lba_t last = NULL_PTR;
+	while (block != NULL_PTR)
+	{
+		if (block < 0 || block >= (lba_t) EEPROM_FS_NUM_BLOCKS)
+		{
+			snprintf(buf, size, "free block chain runs off the filesystem");
+			return buf;
+		}
+		if (owner[block] == 1)
+		{
+			snprintf(buf, size, "free block chain loops at block %d", block);
+			return buf;
+		}
+		if (owner[block])
+		{
+			snprintf(buf, size, "free block %d is in file %d", block,
+					owner[block] - 2);
+			return buf;
+		}
+		owner[block] = 1;
+		num_free++;
+		last = block;
+		block = next_block_in_chain(block);
+	}
+	if (last != last_free_block)
+	{
+		snprintf(buf, size, "free block chain ends at %d, not %d", last,
+				last_free_block);
+		return buf;
+	}
+#endif
+
+	if (free_space() != (size_t) num_free * DATA_SIZE)
+	{
+		snprintf(buf, size, "free_space() doesn't match %d free blocks",
+				num_free);
+		return buf;
+	}
+
+	*lost = EEPROM_FS_NUM_BLOCKS - num_owned - num_free;
+	return NULL;
+}
+
+/**
+ * Check the free space can be used, by filling as much of it as a file
+ * holds, reading it back and deleting it again
+ *
+ * \return Problem found, or NULL
+ */
+const char* check_spare_file(char* buf, size_t size)
+{
+	size_t n = free_space();
+	if (n > MAX_SIZE)
+	{
+		n = MAX_SIZE;
+	}
+	if (n == 0)
+	{
+		return NULL;
+	}
+
+	fdata_t data[MAX_SIZE];
+	fdata_t stored[MAX_SIZE];
+	for (size_t i = 0; i < n; i++)
+	{
+		data[i] = (fdata_t) (i * 5 + 3);
+	}
+
+	file_handle_t fh = open_for_write(SPARE_FILE);
+	write(&fh, data, n);
+	close(&fh);
+
+	fh = open_for_read(SPARE_FILE);
+	if (fh.filesize != n || pread(&fh, 0, stored, n) != n
+			|| memcmp(data, stored, n) != 0)
+	{
+		snprintf(buf, size, "free space can't be written");
+		return buf;
+	}
+
+	uint16_t lost;
+	const char* problem = check_blocks(&lost, buf, size);
+	if (problem == NULL)
+	{
+		delete(SPARE_FILE);
+		problem = check_blocks(&lost, buf, size);
+	}
+	return problem;
+}
+
+/**
+ * Mount the filesystem after a power cut and check it
+ *
+ * \param lost Set to the number of lost blocks
+ * \return Problem found, or NULL
+ */
+const char* check_after_cut(unsigned int k, uint16_t* lost, char* buf,
+		size_t size)
+{
+	const char* problem;
+
+	init_eepromfs();
+	if ((problem = check_files(k, buf, size)) != NULL
+			|| (problem = check_blocks(lost, buf, size)) != NULL
+			|| (problem = check_spare_file(buf, size)) != NULL)
+	{
+		return problem;
+	}
+
+	// Whatever was repaired when mounting should stay repaired
+	uint16_t lost_again;
+	init_eepromfs();
+	if ((problem = check_files(k, buf, size)) != NULL
+			|| (problem = check_blocks(&lost_again, buf, size)) != NULL)
+	{
+		return problem;
+	}
+	return NULL;
+}
+
+/**
+ * Run the workload from an erased EEPROM, cutting the power part way
+ * through, and check what's left. Cut c is at byte (c / 2) * step, and
+ * leaves the byte erased if c is odd.
+ */
+void run_cut(unsigned long c)
+{
+	cut_result_t* result = &results[c];
+
+	memset(mmap_backend_image(), mmap_backend.erased_value, MMAP_IMAGE_SIZE);
+
+	mmap_backend_set_power_cut((c / 2) * sweep_step, c % 2, cut);
+	if (setjmp(power_cut) == 0)
+	{
+		for (current_op = 0; current_op < num_ops; current_op++)
+		{
+			run_op(current_op);
+		}
+	}
+	mmap_backend_set_power_cut(0, 0, NULL);
+
+	result->op = current_op;
+	if (check_after_cut(current_op, &result->lost, result->problem,
+			sizeof(result->problem)) != NULL)
+	{
+		result->status = CUT_BAD;
+	}
+	else
+	{
+		result->status = result->lost > 0 ? CUT_LOST : CUT_OK;
+	}
+}
+
+/**
+ * A worker's share of the sweep: every count-th cut
+ */
+void run_cuts(unsigned int worker, unsigned int count)
+{
+	for (unsigned long c = worker; c < sweep_cuts; c += count)
+	{
+		workers_watchdog(CUT_TIMEOUT);
+		run_cut(c);
+	}
+	workers_watchdog(0);
+}
+
+/**
+ * Build a workload, and check it runs without a power cut
+ *
+ * \param total Set to the number of bytes it programs
+ * \return 0 if it runs
+ */
+int prepare_workload(const workload_t* w, unsigned long* total)
+{
+	num_ops = 0;
+	memset(sizes[0], 0, sizeof(sizes[0]));
+	w->build();
+
+	memset(mmap_backend_image(), mmap_backend.erased_value, MMAP_IMAGE_SIZE);
+	mmap_backend_reset_stats();
+	for (unsigned int k = 0; k < num_ops; k++)
+	{
+		run_op(k);
+	}
+	mmap_stats_t stats = mmap_backend_stats();
+	*total = stats.bytes_written + stats.bytes_write_only;
+
+	char buf[80];
+	uint16_t lost;
+	const char* problem = check_files(num_ops, buf, sizeof(buf));
+	if (problem == NULL)
+	{
+		problem = check_blocks(&lost, buf, sizeof(buf));
+	}
+	if (problem != NULL)
+	{
+		printf("Workload %s fails without a power cut: %s\n", w->name,
+				problem);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Cut the power at every step-th byte a workload programs, sharing the cuts
+ * out between workers, and report what they found
+ *
+ * \return Number of cuts that left the filesystem inconsistent
+ */
+unsigned long sweep(const workload_t* w, unsigned int workers,
+		unsigned long step)
+{
+	unsigned long total;
+	if (prepare_workload(w, &total) != 0)
+	{
+		return 1;
+	}
+	printf("Workload %s: %u operations, %lu bytes programmed\n", w->name,
+			num_ops, total);
+
+	sweep_step = step;
+	sweep_cuts = 2 * ((total + step - 1) / step);
+	size_t results_size = sweep_cuts * sizeof(cut_result_t);
+	results = workers_shared(results_size);
+	if (results == NULL)
+	{
+		printf("Couldn't share memory with the workers\n");
+		return 1;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	workers_run(workers, run_cuts);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	unsigned long failures = 0;
+	unsigned long hung = 0;
+	unsigned long lossy = 0;
+	uint16_t most_lost = 0;
+
+	for (unsigned long c = 0; c < sweep_cuts; c++)
+	{
+		cut_result_t* result = &results[c];
+		if (result->status == CUT_BAD || result->status == CUT_NOT_RUN)
+		{
+			if (failures < MAX_REPORTS)
+			{
+				printf("Cut at byte %lu%s", (c / 2) * step,
+						c % 2 ? ", left erased" : "");
+				if (result->status == CUT_BAD)
+				{
+					printf(" (operation %u): %s\n", result->op, result->problem);
+				}
+				else
+				{
+					printf(": hung or crashed\n");
+				}
+			}
+			failures++;
+			hung += result->status == CUT_NOT_RUN;
+		}
+		else if (result->status == CUT_LOST)
+		{
+			lossy++;
+			if (result->lost > most_lost)
+			{
+				most_lost = result->lost;
+			}
+		}
+	}
+
+	printf("Power cuts: %lu, inconsistent: %lu", sweep_cuts, failures);
+	if (hung > 0)
+	{
+		printf(" (%lu hung or crashed)", hung);
+	}
+	printf(", losing blocks: %lu", lossy);
+	if (lossy > 0)
+	{
+		printf(" (at most %u)", most_lost);
+	}
+	printf(", %.2f s on %u workers\n",
+			(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+			workers);
+
+	workers_free_shared(results, results_size);
+	return failures;
+}
+
+int main(int argc, char** argv)
+{
+	const char* name = argc > 1 ? argv[1] : "all";
+	unsigned int workers = argc > 2 ? strtoul(argv[2], NULL, 0) : 0;
+	unsigned long step = argc > 3 ? strtoul(argv[3], NULL, 0) : 1;
+	if (workers == 0)
+	{
+		workers = workers_available();
+	}
+	if (step == 0)
+	{
+		step = 1;
+	}
+
+	if (mmap_backend_open(NULL) != 0)
+	{
+		fprintf(stderr, "Couldn't map an EEPROM image\n");
+		return 1;
+	}
+	set_backend(&mmap_backend);
+
+	printf("Journal slots: %d, wear-aware: %d, free bitmap: %d, "
+			"mount slots: %d\n", EEPROM_FS_JOURNAL_SLOTS, EEPROM_FS_WEAR_AWARE,
+			EEPROM_FS_FREE_BITMAP, EEPROM_FS_MOUNT_SLOTS);
+
+	unsigned long failures = 0;
+	int found = 0;
+	for (size_t i = 0; i < NUM_WORKLOADS; i++)
+	{
+		if (strcmp(name, "all") == 0 || strcmp(name, workloads[i].name) == 0)
+		{
+			failures += sweep(&workloads[i], workers, step);
+			found = 1;
+		}
+	}
+	if (!found)
+	{
+		fprintf(stderr, "No workload called %s\n", name);
+	}
+
+	mmap_backend_close();
+	return failures > 0 || !found;
+}
@@ -0,0 +1,137 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Filename test: filenames from EEPROM_FS_MAX_FILES up must wrap round onto
+ the files below it, never onto the free space entry that follows the files
+ in the allocation table. Writes, appends to, reads and deletes files by
+ names either side of each multiple of EEPROM_FS_MAX_FILES, and checks the
+ data read back and that fsck_eepromfs() finds nothing wrong, before and
+ after mounting again.
+
+ Usage: test-filenames
+ Exits with 1 if any check fails.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "eeprom-fs.h"
+#include "backend-mmap.h"
+
+unsigned int failures = 0;
+
+/**
+ * Report a failed check
+ */
+void fail(const char* what, fname_t name)
+{
+	printf("FAIL: %s, filename %u\n", what, (unsigned int) name);
+	failures++;
+}
+
+/**
+ * Check the file under the given name holds the given data
+ */
+void check_contents(fname_t name, const char* expected)
+{
+	size_t size = strlen(expected);
+	fdata_t buf[size + 1];
+
+	file_handle_t fh = open_for_read(name);
+	if (fh.filesize != size)
+	{
+		fail("wrong size read back", name);
+		return;
+	}
+	read(&fh, buf);
+	close(&fh);
+	if (memcmp(buf, expected, size) != 0)
+	{
+		fail("wrong data read back", name);
+	}
+}
+
+/**
+ * Check the filesystem has no damage for fsck_eepromfs() to repair
+ */
+void check_clean(const char* when, fname_t name)
+{
+	if (fsck_eepromfs(FSCK_FULL) != 0)
+	{
+		fail(when, name);
+	}
+}
+
+int main()
+{
+	if (mmap_backend_open(NULL) != 0)
+	{
+		fprintf(stderr, "Couldn't map an EEPROM image\n");
+		return 1;
+	}
+	set_backend(&mmap_backend);
+	init_eepromfs();
+
+	const fname_t names[] =
+	{
+		0, EEPROM_FS_MAX_FILES - 1, EEPROM_FS_MAX_FILES,
+		EEPROM_FS_MAX_FILES + 1, 2 * EEPROM_FS_MAX_FILES - 1,
+		2 * EEPROM_FS_MAX_FILES, 0xFFFF
+	};
+	size_t free = free_space();
+
+	for (uint8_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+	{
+		fname_t name = names[i];
+		fname_t wrapped = name % EEPROM_FS_MAX_FILES;
+		char contents[32];
+		snprintf(contents, sizeof(contents), "file %u", (unsigned int) name);
+
+		file_handle_t fh = open_for_write(name);
+		write(&fh, (fdata_t*) contents, strlen(contents));
+		close(&fh);
+		check_contents(name, contents);
+		check_contents(wrapped, contents);
+		check_clean("damage after write", name);
+
+		fh = open_for_append(name);
+		write(&fh, (fdata_t*) "+", 1);
+		close(&fh);
+		strcat(contents, "+");
+		check_contents(wrapped, contents);
+		check_clean("damage after append", name);
+
+		init_eepromfs();
+		check_contents(name, contents);
+		check_clean("damage after mounting again", name);
+
+		delete(name);
+		if (free_space() != free)
+		{
+			fail("file's space not freed by delete", name);
+		}
+		check_clean("damage after delete", name);
+	}
+
+	mmap_backend_close();
+
+	printf("%s\n", failures == 0 ? "PASS" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,357 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ fsck test: damages a filesystem of a few files in each way fsck_eepromfs()
+ repairs, and checks that it finds the damage and repairs it:
+ - fsck_eepromfs(FSCK_FULL) reports at least one problem
+ - a second check, and a check after mounting again, find nothing
+ - every block is in exactly one file or the free space, and can be used
+ - undamaged files read back as written, and a damaged file reads back as
+   a prefix of what was written, or not at all
+ Block links and checkpoints are damaged in the image. An allocation table
+ entry is damaged by committing a bad entry, as if the stored table had been
+ damaged in a way its CRC didn't catch. A file damaged this way, or by a
+ link, can be left holding other files' data: without block CRCs there's no
+ telling which file a block belongs to.
+
+ Usage: test-fsck
+ Exits with 1 if any check fails. Build with -DEEPROM_FS_JOURNAL_SLOTS=0
+ (make test-fsck-static) or other options to test another configuration.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "eeprom-fs.h"
+#include "backend-mmap.h"
+
+#define NULL_PTR -1
+
+#define DATA_SIZE EEPROM_FS_BLOCK_DATA_SIZE
+#define MAX_SIZE (EEPROM_FS_MAX_BLOCKS_PER_FILE * EEPROM_FS_BLOCK_DATA_SIZE)
+
+#define TEST_FILES 5
+#define FILE_BLOCKS 3
+#define FILE_SIZE (FILE_BLOCKS * DATA_SIZE - 1)
+
+/*
+ * Filesystem internals, damaged directly
+ */
+extern file_alloc_t alloc_table[EEPROM_FS_MAX_FILES + 1];
+extern lba_t* const next_free_block;
+void commit_alloc(fname_t index, lba_t old_block, size_t old_size);
+
+unsigned int failures = 0;
+
+/**
+ * Report a failed check
+ */
+void fail(const char* damage, const char* what)
+{
+	printf("FAIL: %s: %s\n", damage, what);
+	failures++;
+}
+
+/**
+ * Returns the data file f is written with
+ */
+fdata_t file_byte(fname_t f, size_t n)
+{
+	return (fdata_t) ('a' + (f * 7 + n) % 26);
+}
+
+/**
+ * Format the filesystem, and write the test files
+ */
+void setup()
+{
+	format_eepromfs(FORMAT_QUICK);
+
+	fdata_t data[FILE_SIZE];
+	for (fname_t f = 0; f < TEST_FILES; f++)
+	{
+		for (size_t n = 0; n < FILE_SIZE; n++)
+		{
+			data[n] = file_byte(f, n);
+		}
+		file_handle_t fh = open_for_write(f);
+		write(&fh, data, FILE_SIZE);
+		close(&fh);
+	}
+}
+
+/**
+ * Returns the image address of a block's link
+ */
+uint8_t* link_pointer(lba_t block)
+{
+	return mmap_backend_image() + EEPROM_FS_START + EEPROM_FS_DATA_OFFSET
+			+ (uintptr_t) block * EEPROM_FS_BLOCK_SIZE
+			+ offsetof(block_t, next_block);
+}
+
+/**
+ * Returns the nth block of a file's chain, read from the image
+ */
+lba_t nth_block(fname_t f, uint8_t n)
+{
+	lba_t block = alloc_table[f].data_block;
+	while (n-- > 0)
+	{
+		memcpy(&block, link_pointer(block), sizeof(lba_t));
+	}
+	return block;
+}
+
+/**
+ * Point a block's link elsewhere in the image
+ */
+void set_link(lba_t block, lba_t target)
+{
+	memcpy(link_pointer(block), &target, sizeof(lba_t));
+}
+
+/*
+ * Kinds of damage
+ */
+
+void damage_loop()
+{
+	set_link(nth_block(1, 1), nth_block(1, 0));
+}
+
+void damage_cross_link()
+{
+	set_link(nth_block(1, 0), nth_block(2, 1));
+}
+
+void damage_out_of_range()
+{
+	set_link(nth_block(1, 1), EEPROM_FS_NUM_BLOCKS + 5);
+}
+
+void damage_bad_start()
+{
+	alloc_table[1].data_block = EEPROM_FS_NUM_BLOCKS + 5;
+	commit_alloc(1, NULL_PTR, 0);
+}
+
+void damage_start_in_file()
+{
+	alloc_table[1].data_block = nth_block(2, 1);
+	commit_alloc(1, NULL_PTR, 0);
+}
+
+void damage_oversized()
+{
+	alloc_table[1].filesize = MAX_SIZE + 1;
+	commit_alloc(1, NULL_PTR, 0);
+}
+
+#if !EEPROM_FS_FREE_BITMAP
+void damage_free_chain_out()
+{
+	set_link(nth_block(EEPROM_FS_MAX_FILES, 1), EEPROM_FS_NUM_BLOCKS + 5);
+}
+
+void damage_free_chain_into_file()
+{
+	set_link(*next_free_block, nth_block(3, 0));
+}
+#endif
+
+#if EEPROM_FS_JOURNAL_SLOTS
+void damage_checkpoint(uint8_t copy)
+{
+	mmap_backend_image()[EEPROM_FS_START + EEPROM_FS_CHECKPOINT_OFFSET
+			+ copy * sizeof(fs_checkpoint_t)
+			+ offsetof(fs_checkpoint_t, table)] ^= 0x5A;
+}
+
+void damage_checkpoint_0()
+{
+	damage_checkpoint(0);
+}
+
+void damage_checkpoint_1()
+{
+	damage_checkpoint(1);
+}
+
+void damage_checkpoints()
+{
+	damage_checkpoint(0);
+	damage_checkpoint(1);
+}
+#endif
+
+typedef struct damage
+{
+	const char* name;
+	void (*damage)(void);
+	// File the damage is to, whose data may be lost
+	fname_t file;
+	// Set if it leaves the file holding other files' blocks
+	uint8_t takes_blocks;
+} damage_t;
+
+const damage_t damages[] =
+{
+	{ "loop", damage_loop, 1, 0 },
+	{ "cross-link", damage_cross_link, 1, 1 },
+	{ "link out of range", damage_out_of_range, 1, 0 },
+	{ "start out of range", damage_bad_start, 1, 0 },
+	{ "start in another file", damage_start_in_file, 1, 1 },
+	{ "oversized file", damage_oversized, 1, 0 },
+#if !EEPROM_FS_FREE_BITMAP
+	{ "free chain out of range", damage_free_chain_out, EEPROM_FS_MAX_FILES,
+			0 },
+	{ "free chain into a file", damage_free_chain_into_file,
+			EEPROM_FS_MAX_FILES, 0 },
+#endif
+#if EEPROM_FS_JOURNAL_SLOTS
+	{ "checkpoint 0 damaged", damage_checkpoint_0, EEPROM_FS_MAX_FILES, 0 },
+	{ "checkpoint 1 damaged", damage_checkpoint_1, EEPROM_FS_MAX_FILES, 0 },
+	{ "both checkpoints damaged", damage_checkpoints, EEPROM_FS_MAX_FILES, 0 },
+#endif
+};
+
+/**
+ * Check each file reads back as a prefix of what was written, all of it if
+ * fsck_eepromfs() didn't cut it short. The damaged file is only checked for
+ * a size it could have.
+ */
+void check_files(const damage_t* d)
+{
+	for (fname_t f = 0; f < TEST_FILES; f++)
+	{
+		size_t size = alloc_table[f].filesize;
+		if (size == 0)
+		{
+			continue;
+		}
+		if (size > FILE_SIZE)
+		{
+			fail(d->name, "file size wrong after repair");
+			continue;
+		}
+
+		fdata_t buf[FILE_SIZE];
+		file_handle_t fh = open_for_read(f);
+		read(&fh, buf);
+		close(&fh);
+		for (size_t n = 0; n < size && f != d->file; n++)
+		{
+			if (buf[n] != file_byte(f, n))
+			{
+				fail(d->name, "file data wrong after repair");
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Check every block is in exactly one file or the free space, by filling
+ * the free space with a file: if a block were in the free space twice, or
+ * in a file too, fsck_eepromfs() would find it afterwards
+ */
+void check_space(const damage_t* d)
+{
+	uint16_t blocks = 0;
+	for (fname_t f = 0; f < EEPROM_FS_MAX_FILES; f++)
+	{
+		blocks += (alloc_table[f].filesize + DATA_SIZE - 1) / DATA_SIZE;
+	}
+	if (free_space() != (size_t) (EEPROM_FS_NUM_BLOCKS - blocks) * DATA_SIZE)
+	{
+		fail(d->name, "free space doesn't hold every block outside the files");
+		return;
+	}
+
+	// Fill what's free, a file at a time
+	fdata_t data[MAX_SIZE];
+	memset(data, 'f', MAX_SIZE);
+	for (fname_t f = TEST_FILES; f < EEPROM_FS_MAX_FILES && free_space() > 0;
+			f++)
+	{
+		size_t size = free_space() < MAX_SIZE ? free_space() : MAX_SIZE;
+		file_handle_t fh = open_for_write(f);
+		write(&fh, data, size);
+		close(&fh);
+	}
+	if (free_space() != 0 || fsck_eepromfs(FSCK_FULL) != 0)
+	{
+		fail(d->name, "free space unusable after repair");
+	}
+}
+
+int main()
+{
+	if (mmap_backend_open(NULL) != 0)
+	{
+		fprintf(stderr, "Couldn't map an EEPROM image\n");
+		return 1;
+	}
+	set_backend(&mmap_backend);
+	init_eepromfs();
+
+	for (uint8_t i = 0; i < sizeof(damages) / sizeof(damages[0]); i++)
+	{
+		const damage_t* d = &damages[i];
+		setup();
+		if (fsck_eepromfs(FSCK_FULL) != 0)
+		{
+			fail(d->name, "damage found before damaging");
+		}
+
+		d->damage();
+		if (fsck_eepromfs(FSCK_FULL) == 0)
+		{
+			fail(d->name, "not found");
+		}
+#if EEPROM_FS_BLOCK_CRC
+		// The blocks the file took fail their CRCs, which a full check
+		// reports every time, as it can't repair data. An application told
+		// its file is corrupt would delete it.
+		if (d->takes_blocks)
+		{
+			delete(d->file);
+		}
+#endif
+		if (fsck_eepromfs(FSCK_FULL) != 0)
+		{
+			fail(d->name, "still found by a second check");
+		}
+		init_eepromfs();
+		if (fsck_eepromfs(FSCK_FULL) != 0)
+		{
+			fail(d->name, "found again after mounting");
+		}
+
+		check_files(d);
+		check_space(d);
+	}
+
+	mmap_backend_close();
+
+	printf("%s\n", failures == 0 ? "PASS" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}
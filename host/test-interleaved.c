@@ -0,0 +1,171 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Interleaved handle test: two files written or appended to through handles
+ open at the same time take blocks from the free space in turn, so neither
+ file's blocks follow each other in the free chain. Writes to the two
+ handles in turn, in pieces of different sizes, and checks each file reads
+ back as written and that fsck_eepromfs() finds nothing wrong, before and
+ after mounting again.
+
+ Usage: test-interleaved
+ Exits with 1 if any check fails.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "eeprom-fs.h"
+#include "backend-mmap.h"
+
+#define MAX_SIZE (EEPROM_FS_MAX_BLOCKS_PER_FILE * EEPROM_FS_BLOCK_DATA_SIZE)
+
+unsigned int failures = 0;
+
+/**
+ * Report a failed check
+ */
+void fail(const char* what, size_t piece)
+{
+	printf("FAIL: %s, pieces of %u bytes\n", what, (unsigned int) piece);
+	failures++;
+}
+
+/**
+ * Check a file holds size bytes of the given character
+ */
+void check_contents(fname_t file, fdata_t c, size_t size, size_t piece)
+{
+	fdata_t buf[MAX_SIZE];
+
+	file_handle_t fh = open_for_read(file);
+	read(&fh, buf);
+	close(&fh);
+	if (fh.filesize != size)
+	{
+		fail("wrong size read back", piece);
+		return;
+	}
+	for (size_t n = 0; n < size; n++)
+	{
+		if (buf[n] != c)
+		{
+			fail("wrong data read back", piece);
+			return;
+		}
+	}
+}
+
+/**
+ * Write size bytes to each of two handles in turn, piece bytes at a time
+ */
+void write_interleaved(file_handle_t* fx, file_handle_t* fy, size_t size,
+		size_t piece)
+{
+	fdata_t x[MAX_SIZE];
+	fdata_t y[MAX_SIZE];
+	memset(x, 'x', sizeof(x));
+	memset(y, 'y', sizeof(y));
+
+	for (size_t done = 0; done < size; done += piece)
+	{
+		size_t n = size - done < piece ? size - done : piece;
+		write_chunk(fx, x, n);
+		write_chunk(fy, y, n);
+	}
+}
+
+/**
+ * Check both files, and that the filesystem is undamaged
+ */
+void check_files(size_t size_x, size_t size_y, size_t piece)
+{
+	check_contents(1, 'x', size_x, piece);
+	check_contents(2, 'y', size_y, piece);
+	if (fsck_eepromfs(FSCK_FULL) != 0)
+	{
+		fail("damage found", piece);
+	}
+}
+
+int main()
+{
+	if (mmap_backend_open(NULL) != 0)
+	{
+		fprintf(stderr, "Couldn't map an EEPROM image\n");
+		return 1;
+	}
+	set_backend(&mmap_backend);
+	init_eepromfs();
+
+	// Less than a block, a block, and more, at a time
+	const size_t pieces[] =
+	{
+		1, EEPROM_FS_BLOCK_DATA_SIZE - 1, EEPROM_FS_BLOCK_DATA_SIZE,
+		EEPROM_FS_BLOCK_DATA_SIZE + 1, 40
+	};
+	size_t size = MAX_SIZE / 4;
+
+	for (uint8_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++)
+	{
+		size_t piece = pieces[i];
+		format_eepromfs(FORMAT_QUICK);
+		size_t free = free_space();
+
+		// Two new files
+		file_handle_t fx = open_for_write(1);
+		file_handle_t fy = open_for_write(2);
+		write_interleaved(&fx, &fy, size, piece);
+		close(&fx);
+		close(&fy);
+		check_files(size, size, piece);
+
+		// Appending to both
+		fx = open_for_append(1);
+		fy = open_for_append(2);
+		write_interleaved(&fx, &fy, size, piece);
+		close(&fy);
+		close(&fx);
+		check_files(2 * size, 2 * size, piece);
+
+		// Rewriting one while appending to the other
+		fx = open_for_write(1);
+		fy = open_for_append(2);
+		write_interleaved(&fx, &fy, MAX_SIZE - 2 * size, piece);
+		close(&fx);
+		close(&fy);
+		check_files(MAX_SIZE - 2 * size, MAX_SIZE, piece);
+
+		init_eepromfs();
+		check_files(MAX_SIZE - 2 * size, MAX_SIZE, piece);
+
+		delete(1);
+		delete(2);
+		if (free_space() != free)
+		{
+			fail("space not freed by delete", piece);
+		}
+	}
+
+	mmap_backend_close();
+
+	printf("%s\n", failures == 0 ? "PASS" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,149 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Static wear levelling test: wear_level() moves a file off blocks much less
+ worn than the free ones, and the file reads back as written. If a block of
+ the file fails its CRC, the move stops short, and the blocks the copy took
+ must go back to the free space rather than be lost until an fsck.
+
+ Usage: test-wear-level
+ Exits with 1 if any check fails. Needs -DEEPROM_FS_WEAR_AWARE=1
+ -DEEPROM_FS_BLOCK_CRC=16.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "eeprom-fs.h"
+#include "backend-mmap.h"
+
+#if !EEPROM_FS_WEAR_AWARE || !EEPROM_FS_BLOCK_CRC
+#error "test-wear-level needs EEPROM_FS_WEAR_AWARE and EEPROM_FS_BLOCK_CRC"
+#endif
+
+#define FILE_SIZE (3 * EEPROM_FS_BLOCK_DATA_SIZE)
+
+/*
+ * Filesystem internals, worn and damaged directly
+ */
+extern file_alloc_t alloc_table[EEPROM_FS_MAX_FILES + 1];
+extern uint16_t block_wear[EEPROM_FS_NUM_BLOCKS];
+lba_t next_block_in_chain(lba_t block);
+
+unsigned int failures = 0;
+
+fdata_t data[FILE_SIZE];
+
+/**
+ * Report a failed check
+ */
+void fail(const char* what)
+{
+	printf("FAIL: %s\n", what);
+	failures++;
+}
+
+/**
+ * Format the filesystem, write file 0, and wear every other block past the
+ * threshold for wear_level() to move it
+ */
+void setup()
+{
+	format_eepromfs(FORMAT_QUICK);
+
+	file_handle_t fh = open_for_write(0);
+	write(&fh, data, FILE_SIZE);
+	close(&fh);
+
+	for (lba_t i = 0; i < (lba_t) EEPROM_FS_NUM_BLOCKS; i++)
+	{
+		block_wear[i] += 2 * EEPROM_FS_STATIC_WEAR_THRESHOLD;
+	}
+	lba_t block = alloc_table[0].data_block;
+	for (uint8_t n = 0; n < FILE_SIZE / EEPROM_FS_BLOCK_DATA_SIZE; n++)
+	{
+		block_wear[block] -= 2 * EEPROM_FS_STATIC_WEAR_THRESHOLD;
+		block = next_block_in_chain(block);
+	}
+}
+
+int main()
+{
+	if (mmap_backend_open(NULL) != 0)
+	{
+		fprintf(stderr, "Couldn't map an EEPROM image\n");
+		return 1;
+	}
+	set_backend(&mmap_backend);
+	init_eepromfs();
+
+	for (size_t n = 0; n < FILE_SIZE; n++)
+	{
+		data[n] = (fdata_t) ('a' + n % 26);
+	}
+
+	// A file on cold blocks is moved, and reads back as written
+	setup();
+	size_t free = free_space();
+	lba_t old_block = alloc_table[0].data_block;
+	if (wear_level() != 1 || alloc_table[0].data_block == old_block)
+	{
+		fail("cold file not moved");
+	}
+	fdata_t buf[FILE_SIZE];
+	file_handle_t fh = open_for_read(0);
+	read(&fh, buf);
+	close(&fh);
+	if (fh.filesize != FILE_SIZE || memcmp(buf, data, FILE_SIZE) != 0)
+	{
+		fail("moved file reads back wrong");
+	}
+	if (free_space() != free || fsck_eepromfs(FSCK_FULL) != 0)
+	{
+		fail("damage after moving a file");
+	}
+
+	// A file that fails its CRC part way is left where it is, and the
+	// blocks the copy took are freed
+	setup();
+	old_block = alloc_table[0].data_block;
+	mmap_backend_image()[EEPROM_FS_START + EEPROM_FS_DATA_OFFSET
+			+ (uintptr_t) next_block_in_chain(old_block) * EEPROM_FS_BLOCK_SIZE
+			+ offsetof(block_t, data)] ^= 0x5A;
+	if (wear_level() != 0 || alloc_table[0].data_block != old_block)
+	{
+		fail("damaged file moved");
+	}
+	if (free_space() != free)
+	{
+		fail("blocks of the truncated copy not freed");
+	}
+	// The damaged file is reported by every check until it's deleted
+	delete(0);
+	if (fsck_eepromfs(FSCK_FULL) != 0)
+	{
+		fail("damage after a failed move");
+	}
+
+	mmap_backend_close();
+
+	printf("%s\n", failures == 0 ? "PASS" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}
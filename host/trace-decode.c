@@ -0,0 +1,316 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Decoder for the trace dump_trace() prints with EEPROM_FS_TRACE set: renders
+ a timeline of the operations, nested in the ones that called them, and a
+ histogram of each operation's latency. Operations are recorded as they
+ finish, so the oldest in a full ring may be missing the operation that
+ called them, and are shown at the top level.
+
+ Usage: trace-decode [tick_us] < dump
+ tick_us is the length of a tick of the clock given to set_fs_clock(), in
+ microseconds (1 by default). Lines around the dump are ignored; if there's
+ more than one dump, the last is decoded.
+
+ Entries hold 16-bit tick counts, so the decoder can only place them in time
+ if no more than 65535 ticks pass between one operation finishing and the
+ next. Durations that long are saturated, and shown with a '>'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eeprom-fs.h"
+
+#define MAX_ENTRIES 4096
+#define HIST_BUCKETS 18
+#define BAR_WIDTH 40
+
+const char* op_names[TRACE_NUM_OPS] =
+{
+	[TRACE_INIT] = "init",
+	[TRACE_UNMOUNT] = "unmount",
+	[TRACE_FORMAT] = "format",
+	[TRACE_FSCK] = "fsck",
+	[TRACE_OPEN_WRITE] = "open_write",
+	[TRACE_OPEN_APPEND] = "open_append",
+	[TRACE_OPEN_READ] = "open_read",
+	[TRACE_CLOSE] = "close",
+	[TRACE_WRITE] = "write",
+	[TRACE_READ] = "read",
+	[TRACE_SEEK] = "seek",
+	[TRACE_DELETE] = "delete",
+	[TRACE_FREE_SPACE] = "free_space",
+	[TRACE_WEAR_LEVEL] = "wear_level",
+	[TRACE_FLUSH] = "flush",
+	[TRACE_LINK] = "link",
+	[TRACE_UNLINK] = "unlink",
+	[TRACE_RELINK] = "relink"
+};
+
+/*
+ * Traced operation, placed in time
+ */
+typedef struct event
+{
+	unsigned int op;
+	unsigned int file;
+	int block;
+	long long start;
+	long long end;
+	unsigned int duration;
+	// Number of traced operations it was called within
+	unsigned int depth;
+	// First operation it called, and the next called by its caller
+	int child;
+	int sibling;
+} event_t;
+
+event_t events[MAX_ENTRIES];
+unsigned int num_events = 0;
+
+/**
+ * Read the last dump from stdin
+ *
+ * \return 0 if a dump was found
+ */
+int read_dump()
+{
+	char line[128];
+	int found = 0;
+
+	while (fgets(line, sizeof(line), stdin) != NULL)
+	{
+		unsigned int op, file, block, start, duration;
+
+		if (strncmp(line, "eeprom-fs trace", 15) == 0)
+		{
+			found = 1;
+			num_events = 0;
+		}
+		else if (found && num_events < MAX_ENTRIES
+				&& sscanf(line, "T %x %x %x %x %x", &op, &file, &block, &start,
+						&duration) == 5)
+		{
+			event_t* e = &events[num_events];
+			e->op = op & TRACE_OP_MASK;
+			e->depth = op >> TRACE_DEPTH_SHIFT;
+			e->file = file;
+			e->block = (int16_t) block;
+			// Unwrapped below
+			e->start = start;
+			e->duration = duration;
+			num_events++;
+		}
+	}
+
+	return found ? 0 : -1;
+}
+
+/**
+ * Place the operations in time, from their 16-bit start and duration.
+ * Operations finish in the order they're recorded, so their end times only
+ * go forwards, and can be unwrapped one from the next.
+ */
+void unwrap()
+{
+	long long end = 0;
+	uint16_t last_end = 0;
+
+	for (unsigned int i = 0; i < num_events; i++)
+	{
+		event_t* e = &events[i];
+		uint16_t this_end = (uint16_t) (e->start + e->duration);
+
+		end += i == 0 ? this_end : (uint16_t) (this_end - last_end);
+		last_end = this_end;
+
+		e->end = end;
+		e->start = end - e->duration;
+	}
+}
+
+/**
+ * Find the operations each operation called. Operations finish after the ones
+ * they call, and are recorded with how deeply they're nested, so an
+ * operation called those nested deeper than it that finished just before it.
+ *
+ * \return Number of operations that weren't called by others, left at the
+ *         start of roots in the order they ran
+ */
+unsigned int find_callers(int* roots)
+{
+	unsigned int pending = 0;
+
+	for (unsigned int i = 0; i < num_events; i++)
+	{
+		event_t* e = &events[i];
+		e->child = -1;
+		e->sibling = -1;
+
+		while (pending > 0 && events[roots[pending - 1]].depth > e->depth)
+		{
+			int c = roots[--pending];
+			events[c].sibling = e->child;
+			e->child = c;
+		}
+
+		roots[pending++] = i;
+	}
+
+	return pending;
+}
+
+/**
+ * Print an operation and those it called, indented by how deeply they're
+ * nested
+ */
+void print_event(int i, long long origin, double tick_us)
+{
+	event_t* e = &events[i];
+
+	printf("%12.1f %c%11.1f  %*s%s", (e->start - origin) * tick_us,
+			e->duration == UINT16_MAX ? '>' : ' ', e->duration * tick_us,
+			e->depth * 2, "", e->op < TRACE_NUM_OPS ? op_names[e->op] : "?");
+	if (e->file != TRACE_NO_FILE)
+	{
+		printf(" file %u", e->file);
+	}
+	// Blocks are numbered from 0, and -1 is none
+	if (e->block >= 0)
+	{
+		printf(" block %d", e->block);
+	}
+	printf("\n");
+
+	for (int c = e->child; c >= 0; c = events[c].sibling)
+	{
+		print_event(c, origin, tick_us);
+	}
+}
+
+/**
+ * Print each operation in the order they started, under the operations that
+ * called them
+ */
+void print_timeline(double tick_us)
+{
+	int roots[MAX_ENTRIES];
+	unsigned int num_roots = find_callers(roots);
+	long long origin = num_roots > 0 ? events[roots[0]].start : 0;
+
+	printf("%12s %12s  operation\n", "start us", "took us");
+
+	for (unsigned int r = 0; r < num_roots; r++)
+	{
+		print_event(roots[r], origin, tick_us);
+	}
+}
+
+/**
+ * Print the number of calls, latencies and a histogram of latencies of each
+ * operation, in buckets of powers of two ticks
+ */
+void print_histograms(double tick_us)
+{
+	for (unsigned int op = 0; op < TRACE_NUM_OPS; op++)
+	{
+		unsigned int count = 0, min = UINT16_MAX, max = 0;
+		unsigned long long total = 0;
+		unsigned int hist[HIST_BUCKETS] = { 0 };
+
+		for (unsigned int i = 0; i < num_events; i++)
+		{
+			event_t* e = &events[i];
+			if (e->op != op)
+			{
+				continue;
+			}
+
+			count++;
+			total += e->duration;
+			min = e->duration < min ? e->duration : min;
+			max = e->duration > max ? e->duration : max;
+
+			// Bucket 0 is 0 ticks, bucket n is under 2^n
+			unsigned int bucket = 0;
+			while ((e->duration >> bucket) > 0)
+			{
+				bucket++;
+			}
+			hist[bucket]++;
+		}
+
+		if (count == 0)
+		{
+			continue;
+		}
+
+		printf("\n%s: %u calls, min %.1f us, mean %.1f us, max %.1f us\n",
+				op_names[op], count, min * tick_us,
+				(double) total / count * tick_us, max * tick_us);
+
+		unsigned int peak = 0;
+		for (unsigned int b = 0; b < HIST_BUCKETS; b++)
+		{
+			peak = hist[b] > peak ? hist[b] : peak;
+		}
+
+		for (unsigned int b = 0; b < HIST_BUCKETS; b++)
+		{
+			if (hist[b] == 0)
+			{
+				continue;
+			}
+
+			char bar[BAR_WIDTH + 1];
+			unsigned int len = (hist[b] * BAR_WIDTH + peak - 1) / peak;
+			memset(bar, '#', len);
+			bar[len] = '\0';
+
+			printf("  < %10.1f us %6u %s\n", (double) (1UL << b) * tick_us,
+					hist[b], bar);
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	double tick_us = argc > 1 ? strtod(argv[1], NULL) : 1;
+	if (tick_us <= 0)
+	{
+		tick_us = 1;
+	}
+
+	if (read_dump() != 0)
+	{
+		fprintf(stderr, "No eeprom-fs trace found\n");
+		return 1;
+	}
+
+	unwrap();
+
+	printf("%u operations, %.1f us per tick\n\n", num_events, tick_us);
+	print_timeline(tick_us);
+	print_histograms(tick_us);
+
+	return 0;
+}
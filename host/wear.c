@@ -0,0 +1,670 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Wear simulation: replays workload profiles on an emulated EEPROM and
+ reports how hard the metadata and data areas have been worn, how many
+ commits the hottest byte would last, and how many days that is at the
+ profile's rate of commits. Each profile runs in its own worker process, in
+ parallel, and a heatmap shows where each one wore the EEPROM.
+
+ Usage: wear [profile|all [commits [per_day [hotspots]]]]
+ Profiles (all by default):
+ - mixed: mostly small rewrites of a handful of files, some appends, a
+   settings file rewritten now and then, and calibration data written once
+ - config: a settings file rewritten with a few bytes changed each time
+ - log: fixed-size records appended to a ring of log files, each deleted
+   and started again when the next one fills
+ - churn: random rewrites, appends and deletes across all
+   EEPROM_FS_MAX_FILES files
+ Each profile runs for the given number of commits (100000 by default).
+ per_day overrides each profile's own rate of commits per day. Lists the
+ given number of most written addresses (8 by default), and what each one
+ holds.
+ Build with -DEEPROM_FS_JOURNAL_SLOTS=0 (make wear-static) to compare
+ against a static allocation table, or with -DEEPROM_FS_WEAR_AWARE=1
+ (make wear-aware) to compare against wear-aware block allocation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eeprom-fs.h"
+#include "backend-mmap.h"
+#include "workers.h"
+
+/*
+ * Erase/write cycles each EEPROM byte is rated for
+ */
+#define ENDURANCE 100000UL
+
+#define MAX_SIZE (EEPROM_FS_MAX_BLOCKS_PER_FILE * EEPROM_FS_BLOCK_DATA_SIZE)
+
+#define WORKLOAD_FILES 6
+// Average number of commits between rewrites of the settings file
+#define SETTINGS_INTERVAL 2000
+
+#define CONFIG_SIZE 40
+// Bytes of the settings that change in each rewrite
+#define CONFIG_CHANGES 2
+
+#define LOG_FILES 4
+#define LOG_RECORD_SIZE 16
+
+// Seconds a profile may run for before it's taken to have hung
+#define PROFILE_TIMEOUT 600
+
+typedef struct region_wear
+{
+	uint32_t max;
+	uintptr_t max_addr;
+	uint64_t total;
+} region_wear_t;
+
+uint32_t rng_state = 1;
+
+/**
+ * Deterministic pseudo-random numbers, so runs can be compared
+ */
+uint32_t rng(uint32_t range)
+{
+	rng_state = rng_state * 1103515245UL + 12345;
+	return (rng_state >> 16) % range;
+}
+
+/**
+ * Summarise the wear of part of the image
+ */
+region_wear_t region_wear(uintptr_t start, uintptr_t end)
+{
+	region_wear_t w = { 0, start, 0 };
+	for (uintptr_t i = start; i < end; i++)
+	{
+		w.total += mmap_wear[i];
+		if (mmap_wear[i] > w.max)
+		{
+			w.max = mmap_wear[i];
+			w.max_addr = i;
+		}
+	}
+	return w;
+}
+
+/**
+ * Describe what an image address holds
+ */
+void describe_address(uintptr_t addr, char* buf, size_t size)
+{
+	uintptr_t offset = addr - EEPROM_FS_START;
+
+	if (offset < sizeof(fs_meta_t))
+	{
+		snprintf(buf, size, "metadata");
+	}
+#if EEPROM_FS_JOURNAL_SLOTS
+	else if (offset < EEPROM_FS_JOURNAL_OFFSET)
+	{
+		offset -= EEPROM_FS_CHECKPOINT_OFFSET;
+		snprintf(buf, size, "checkpoint %lu +%lu",
+				(unsigned long) (offset / sizeof(fs_checkpoint_t)),
+				(unsigned long) (offset % sizeof(fs_checkpoint_t)));
+	}
+	else if (offset < EEPROM_FS_MOUNT_OFFSET)
+	{
+		offset -= EEPROM_FS_JOURNAL_OFFSET;
+		snprintf(buf, size, "journal slot %lu +%lu",
+				(unsigned long) (offset / sizeof(fs_journal_record_t)),
+				(unsigned long) (offset % sizeof(fs_journal_record_t)));
+	}
+#if EEPROM_FS_MOUNT_SLOTS
+	else if (offset < EEPROM_FS_DATA_OFFSET)
+	{
+		offset -= EEPROM_FS_MOUNT_OFFSET;
+		snprintf(buf, size, "mount slot %lu +%lu",
+				(unsigned long) (offset / sizeof(fs_mount_state_t)),
+				(unsigned long) (offset % sizeof(fs_mount_state_t)));
+	}
+#endif
+#else
+	else if (offset < EEPROM_FS_DATA_OFFSET)
+	{
+		offset -= EEPROM_FS_ALLOC_TABLE_OFFSET;
+		unsigned long entry = offset / sizeof(file_alloc_t);
+		if (entry == EEPROM_FS_MAX_FILES)
+		{
+			snprintf(buf, size, "free chain entry +%lu",
+					(unsigned long) (offset % sizeof(file_alloc_t)));
+		}
+		else
+		{
+			snprintf(buf, size, "alloc entry %lu +%lu", entry,
+					(unsigned long) (offset % sizeof(file_alloc_t)));
+		}
+	}
+#endif
+	else
+	{
+		offset -= EEPROM_FS_DATA_OFFSET;
+		snprintf(buf, size, "block %lu +%lu",
+				(unsigned long) (offset / EEPROM_FS_BLOCK_SIZE),
+				(unsigned long) (offset % EEPROM_FS_BLOCK_SIZE));
+	}
+}
+
+/**
+ * List the most written addresses of the image
+ */
+void print_hotspots(unsigned int count, unsigned long commits)
+{
+	uint8_t listed[MMAP_IMAGE_SIZE];
+	memset(listed, 0, sizeof(listed));
+
+	printf("Hottest addresses:\n");
+	for (unsigned int n = 0; n < count; n++)
+	{
+		uintptr_t hottest = 0;
+		int found = 0;
+		for (uintptr_t i = 0; i < MMAP_IMAGE_SIZE; i++)
+		{
+			if (!listed[i] && (!found || mmap_wear[i] > mmap_wear[hottest]))
+			{
+				hottest = i;
+				found = 1;
+			}
+		}
+		if (!found)
+		{
+			break;
+		}
+		listed[hottest] = 1;
+
+		char name[40];
+		describe_address(hottest, name, sizeof(name));
+		printf("  %#06lx %-24s %8lu writes  %.3f per commit\n",
+				(unsigned long) hottest, name, (unsigned long) mmap_wear[hottest],
+				(double) mmap_wear[hottest] / commits);
+	}
+}
+
+/**
+ * Summarise the wear of the data blocks, taking the most written byte of
+ * each block as its wear
+ */
+void print_block_wear(uintptr_t data_start)
+{
+	uint32_t max = 0;
+	uint32_t min = UINT32_MAX;
+	uint64_t total = 0;
+
+	for (uint16_t b = 0; b < EEPROM_FS_NUM_BLOCKS; b++)
+	{
+		region_wear_t w = region_wear(data_start + b * EEPROM_FS_BLOCK_SIZE,
+				data_start + (b + 1) * EEPROM_FS_BLOCK_SIZE);
+		total += w.max;
+		if (w.max > max)
+		{
+			max = w.max;
+		}
+		if (w.max < min)
+		{
+			min = w.max;
+		}
+	}
+
+	double mean = (double) total / EEPROM_FS_NUM_BLOCKS;
+	printf("Block wear: min %lu, max %lu, mean %.1f, max/mean %.3f\n",
+			(unsigned long) min, (unsigned long) max, mean,
+			mean > 0 ? max / mean : 0);
+}
+
+void print_region(const char* name, region_wear_t w, uintptr_t size)
+{
+	printf("%-10s %5lu bytes  max %8lu writes at %#06lx  mean %10.1f\n", name,
+			(unsigned long) size, (unsigned long) w.max,
+			(unsigned long) w.max_addr, (double) w.total / size);
+}
+
+/**
+ * Show how hard each byte of the image has been worn, a row per block, from
+ * ' ' for unwritten to '@' for the hottest
+ */
+void print_heatmap(uintptr_t data_start)
+{
+	const char shades[] = " .:-=+*#%@";
+	uint32_t max = 0;
+	for (uintptr_t i = EEPROM_FS_START; i < MMAP_IMAGE_SIZE; i++)
+	{
+		max = mmap_wear[i] > max ? mmap_wear[i] : max;
+	}
+	if (max == 0)
+	{
+		return;
+	}
+
+	printf("Heatmap (%lu writes = '@'):\n", (unsigned long) max);
+	for (uintptr_t row = EEPROM_FS_START; row < MMAP_IMAGE_SIZE;)
+	{
+		// Rows of metadata stop where the blocks start
+		uintptr_t end = row + EEPROM_FS_BLOCK_SIZE;
+		if (row < data_start && end > data_start)
+		{
+			end = data_start;
+		}
+		if (end > MMAP_IMAGE_SIZE)
+		{
+			end = MMAP_IMAGE_SIZE;
+		}
+
+		if (row < data_start)
+		{
+			printf("  0x%04lx metadata  |", (unsigned long) row);
+		}
+		else if (row < data_start + EEPROM_FS_NUM_BLOCKS * EEPROM_FS_BLOCK_SIZE)
+		{
+			printf("  0x%04lx block %3lu |", (unsigned long) row,
+					(unsigned long) ((row - data_start) / EEPROM_FS_BLOCK_SIZE));
+		}
+		else
+		{
+			printf("  0x%04lx unused    |", (unsigned long) row);
+		}
+		for (uintptr_t i = row; i < end; i++)
+		{
+			uint32_t w = mmap_wear[i];
+			putchar(shades[w == 0 ? 0 : 1 + (uint64_t) (w - 1) * 9 / max]);
+		}
+		printf("|\n");
+
+		row = end;
+	}
+}
+
+/*
+ * Workload profiles
+ */
+
+fdata_t data[MAX_SIZE];
+// Number of files wear_level() has moved
+unsigned long moves = 0;
+
+/**
+ * Fill the start of the data to write with random bytes
+ */
+void random_data(size_t n)
+{
+	for (size_t j = 0; j < n; j++)
+	{
+		data[j] = 'a' + rng(26);
+	}
+}
+
+/**
+ * Write a file from the data
+ */
+void write_file(fname_t file, size_t size)
+{
+	file_handle_t fh = open_for_write(file);
+	write(&fh, data, size);
+	close(&fh);
+}
+
+/**
+ * Give the filesystem the idle time it would have between commits
+ */
+void idle()
+{
+#if EEPROM_FS_WEAR_AWARE
+	moves += wear_level();
+#endif
+}
+
+/**
+ * A logger: mostly small rewrites of a handful of files, some appends, and
+ * a settings file that is only rewritten now and then
+ */
+void profile_mixed(unsigned long commits)
+{
+	size_t sizes[WORKLOAD_FILES] = { 0 };
+
+	// Calibration data, written once and never again
+	// (it doesn't count as a commit)
+	memset(data, 'c', MAX_SIZE);
+	write_file(WORKLOAD_FILES, MAX_SIZE);
+
+	for (unsigned long i = 0; i < commits; i++)
+	{
+		fname_t f = rng(WORKLOAD_FILES - 1);
+		if (rng(SETTINGS_INTERVAL) == 0)
+		{
+			f = WORKLOAD_FILES - 1;
+		}
+		size_t n = 1 + rng(EEPROM_FS_BLOCK_DATA_SIZE * 3);
+		random_data(n);
+
+		file_handle_t fh;
+		if (rng(4) == 0 && sizes[f] > 0 && sizes[f] + n <= MAX_SIZE)
+		{
+			fh = open_for_append(f);
+			sizes[f] += n;
+		}
+		else
+		{
+			fh = open_for_write(f);
+			sizes[f] = n;
+		}
+		write(&fh, data, n);
+		close(&fh);
+
+		idle();
+	}
+}
+
+/**
+ * Settings saved periodically: the same file rewritten whole, with only a
+ * few bytes changed, next to calibration data that never changes
+ */
+void profile_config(unsigned long commits)
+{
+	memset(data, 'c', MAX_SIZE);
+	write_file(WORKLOAD_FILES, MAX_SIZE);
+
+	random_data(CONFIG_SIZE);
+	for (unsigned long i = 0; i < commits; i++)
+	{
+		for (uint8_t c = 0; c < CONFIG_CHANGES; c++)
+		{
+			data[rng(CONFIG_SIZE)] = 'a' + rng(26);
+		}
+		write_file(0, CONFIG_SIZE);
+
+		idle();
+	}
+}
+
+/**
+ * Append-only logging: records appended to one file until it's full, then
+ * to the next of a ring of files, which is deleted and started again
+ */
+void profile_log(unsigned long commits)
+{
+	fname_t file = 0;
+	size_t size = 0;
+	// Whether each file has been written yet
+	uint8_t written[LOG_FILES] = { 1 };
+
+	for (unsigned long i = 0; i < commits; i++)
+	{
+		if (size + LOG_RECORD_SIZE > MAX_SIZE)
+		{
+			file = (file + 1) % LOG_FILES;
+			size = 0;
+			if (written[file])
+			{
+				// Deleting the oldest log is a commit too
+				delete(file);
+				idle();
+				if (++i == commits)
+				{
+					break;
+				}
+			}
+			written[file] = 1;
+		}
+
+		random_data(LOG_RECORD_SIZE);
+		file_handle_t fh = open_for_append(file);
+		write(&fh, data, LOG_RECORD_SIZE);
+		close(&fh);
+		size += LOG_RECORD_SIZE;
+
+		idle();
+	}
+}
+
+/**
+ * Random churn across every file: rewrites of any size, appends and
+ * deletes, deleting files to make room when the filesystem fills
+ */
+void profile_churn(unsigned long commits)
+{
+	size_t sizes[EEPROM_FS_MAX_FILES] = { 0 };
+
+	for (unsigned long i = 0; i < commits; i++)
+	{
+		// 1 in 5 commits deletes, 1 in 5 appends, and the rest rewrite
+		fname_t f = rng(EEPROM_FS_MAX_FILES);
+		uint8_t op = rng(5);
+		size_t n = 1 + rng(MAX_SIZE);
+
+		if (sizes[f] > 0 && (op == 0 || (op == 1 && sizes[f] + n > MAX_SIZE)))
+		{
+			delete(f);
+			sizes[f] = 0;
+			idle();
+			continue;
+		}
+
+		if (op != 1 || sizes[f] + n > MAX_SIZE)
+		{
+			op = 2;
+		}
+
+		// A rewrite takes its new blocks before it frees the old ones
+		while (free_space() < n)
+		{
+			fname_t victim = rng(EEPROM_FS_MAX_FILES);
+			if (sizes[victim] > 0 && victim != f)
+			{
+				delete(victim);
+				sizes[victim] = 0;
+				idle();
+				if (++i == commits)
+				{
+					return;
+				}
+			}
+		}
+
+		random_data(n);
+		file_handle_t fh;
+		if (op == 1)
+		{
+			fh = open_for_append(f);
+			sizes[f] += n;
+		}
+		else
+		{
+			fh = open_for_write(f);
+			sizes[f] = n;
+		}
+		write(&fh, data, n);
+		close(&fh);
+
+		idle();
+	}
+}
+
+typedef struct profile
+{
+	const char* name;
+	void (*run)(unsigned long commits);
+	// Commits a day it's projected at
+	unsigned long per_day;
+} profile_t;
+
+const profile_t profiles[] =
+{
+	{ "mixed", profile_mixed, 1440 },
+	{ "config", profile_config, 24 },
+	{ "log", profile_log, 1440 },
+	{ "churn", profile_churn, 1440 }
+};
+#define NUM_PROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+/*
+ * What a profile's worker found, in memory shared with the parent
+ */
+typedef struct profile_result
+{
+	uint8_t selected;
+	uint8_t done;
+	unsigned long moves;
+	uint32_t wear[MMAP_IMAGE_SIZE];
+} profile_result_t;
+
+profile_result_t* results;
+unsigned long commits;
+
+/**
+ * Run this worker's share of the selected profiles, each on a
+ * freshly formatted EEPROM
+ */
+void work(unsigned int worker, unsigned int count)
+{
+	for (unsigned int p = worker; p < NUM_PROFILES; p += count)
+	{
+		if (!results[p].selected)
+		{
+			continue;
+		}
+
+		if (mmap_backend_open(NULL) != 0)
+		{
+			fprintf(stderr, "Couldn't map an EEPROM image\n");
+			return;
+		}
+		set_backend(&mmap_backend);
+		workers_watchdog(PROFILE_TIMEOUT);
+
+		// Every profile sees the same random numbers, whichever worker runs it
+		rng_state = 1;
+		moves = 0;
+		init_eepromfs();
+		mmap_backend_reset_stats();
+		profiles[p].run(commits);
+
+		memcpy(results[p].wear, mmap_wear, sizeof(mmap_wear));
+		results[p].moves = moves;
+		results[p].done = 1;
+		mmap_backend_close();
+	}
+	workers_watchdog(0);
+}
+
+/**
+ * Report the wear a profile left
+ */
+void print_profile(const profile_t* profile, const profile_result_t* result,
+		unsigned long per_day, unsigned int hotspots)
+{
+	memcpy(mmap_wear, result->wear, sizeof(mmap_wear));
+
+	uintptr_t data_start = EEPROM_FS_START + EEPROM_FS_DATA_OFFSET;
+	uintptr_t data_end = data_start
+			+ EEPROM_FS_NUM_BLOCKS * EEPROM_FS_BLOCK_SIZE;
+	region_wear_t meta = region_wear(EEPROM_FS_START, data_start);
+	region_wear_t blocks = region_wear(data_start, data_end);
+
+	printf("== Profile %s\n", profile->name);
+	printf("Journal slots: %d, wear-aware: %d, data blocks: %d, commits: %lu\n",
+			EEPROM_FS_JOURNAL_SLOTS, EEPROM_FS_WEAR_AWARE,
+			(int) EEPROM_FS_NUM_BLOCKS, commits);
+	print_region("metadata", meta, data_start - EEPROM_FS_START);
+	print_region("data", blocks, data_end - data_start);
+	print_block_wear(data_start);
+	if (result->moves > 0)
+	{
+		printf("Files moved by wear_level(): %lu\n", result->moves);
+	}
+
+	print_hotspots(hotspots, commits);
+
+	uint32_t hottest = meta.max > blocks.max ? meta.max : blocks.max;
+	if (hottest > 0)
+	{
+		// Wear grows linearly with commits, once the files are first written
+		double lifetime = (double) ENDURANCE * commits / hottest;
+		printf("Lifetime: %.0f commits until the hottest byte (in %s) reaches "
+				"%lu cycles\n", lifetime,
+				meta.max > blocks.max ? "metadata" : "data", ENDURANCE);
+		printf("At %lu commits a day: %.0f days (%.1f years) to the first "
+				"failed byte\n", per_day, lifetime / per_day,
+				lifetime / per_day / 365.25);
+	}
+
+	print_heatmap(data_start);
+	printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char* name = argc > 1 ? argv[1] : "all";
+	commits = argc > 2 ? strtoul(argv[2], NULL, 0) : 100000;
+	unsigned long per_day = argc > 3 ? strtoul(argv[3], NULL, 0) : 0;
+	unsigned int hotspots = argc > 4 ? strtoul(argv[4], NULL, 0) : 8;
+
+	results = workers_shared(NUM_PROFILES * sizeof(profile_result_t));
+	if (results == NULL)
+	{
+		fprintf(stderr, "Couldn't allocate shared memory\n");
+		return 1;
+	}
+
+	unsigned int selected = 0;
+	for (unsigned int p = 0; p < NUM_PROFILES; p++)
+	{
+		results[p].selected = strcmp(name, "all") == 0
+				|| strcmp(name, profiles[p].name) == 0;
+		selected += results[p].selected;
+	}
+	if (selected == 0)
+	{
+		fprintf(stderr, "Unknown profile %s\n", name);
+		return 1;
+	}
+
+	unsigned int workers = workers_available();
+	if (workers > NUM_PROFILES)
+	{
+		workers = NUM_PROFILES;
+	}
+	workers_run(workers, work);
+
+	int failed = 0;
+	for (unsigned int p = 0; p < NUM_PROFILES; p++)
+	{
+		if (!results[p].selected)
+		{
+			continue;
+		}
+		if (!results[p].done)
+		{
+			fprintf(stderr, "Profile %s didn't finish\n", profiles[p].name);
+			failed = 1;
+			continue;
+		}
+
+		print_profile(&profiles[p], &results[p],
+				per_day > 0 ? per_day : profiles[p].per_day, hotspots);
+	}
+
+	workers_free_shared(results, NUM_PROFILES * sizeof(profile_result_t));
+	return failed;
+}
@@ -0,0 +1,117 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Parallel worker processes for host tools.
+ */
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "workers.h"
+
+/**
+ * Returns the number of CPUs available to run workers on
+ */
+unsigned int workers_available()
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? (unsigned int) cpus : 1;
+}
+
+/**
+ * Allocate zeroed memory that stays shared with workers started afterwards
+ *
+ * \param size Number of bytes
+ * \return The memory, or NULL on failure
+ */
+void* workers_shared(size_t size)
+{
+	void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	return mem == MAP_FAILED ? NULL : mem;
+}
+
+/**
+ * Free memory from workers_shared()
+ *
+ * \param mem The memory
+ * \param size Number of bytes, as allocated
+ */
+void workers_free_shared(void* mem, size_t size)
+{
+	munmap(mem, size);
+}
+
+/**
+ * Run a function in parallel worker processes, and wait for them all
+ *
+ * \param count Number of workers
+ * \param work Function each worker runs, given its number and the count
+ * \return Number of workers that crashed or were stopped by their watchdog
+ */
+unsigned int workers_run(unsigned int count,
+		void (*work)(unsigned int worker, unsigned int count))
+{
+	unsigned int failed = 0;
+
+	// Anything buffered would otherwise be printed by every worker
+	fflush(stdout);
+	fflush(stderr);
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			work(i, count);
+			fflush(stdout);
+			_exit(0);
+		}
+		else if (pid < 0)
+		{
+			// Run it here instead
+			work(i, count);
+		}
+	}
+
+	int status;
+	while (wait(&status) > 0)
+	{
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+/**
+ * Stop the calling worker if it doesn't call this again in time
+ *
+ * \param seconds Time allowed, or 0 to stop the watchdog
+ */
+void workers_watchdog(unsigned int seconds)
+{
+	alarm(seconds);
+}
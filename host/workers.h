@@ -0,0 +1,63 @@
+/*
+ eeprom-fs: a micro EEPROM filesystem
+
+ Copyright (c) 2014 Chris Watts (cw17g12@ecs.soton.ac.uk)
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ==========================================================================
+
+ Parallel worker processes for host tools.
+
+ The filesystem keeps its state in globals, so it can't run in more than one
+ thread at a time. Each worker is a forked process instead, with its own
+ copy of the filesystem and the EEPROM image, reporting back through shared
+ memory. This file doesn't include eeprom-fs.h, as it needs <unistd.h>.
+ */
+
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+#include <stddef.h>
+
+/**
+ * Returns the number of CPUs available to run workers on
+ */
+unsigned int workers_available();
+
+/**
+ * Allocate zeroed memory that stays shared with workers started afterwards.
+ * Returns NULL on failure.
+ */
+void* workers_shared(size_t size);
+/**
+ * Free memory from workers_shared()
+ */
+void workers_free_shared(void* mem, size_t size);
+
+/**
+ * Run work(worker, count) in count worker processes, and wait for them all.
+ * Returns the number of workers that crashed or were stopped by
+ * workers_watchdog().
+ */
+unsigned int workers_run(unsigned int count,
+		void (*work)(unsigned int worker, unsigned int count));
+
+/**
+ * Stop the calling worker if it doesn't call this again within the given
+ * number of seconds, in case it has hung. 0 stops the watchdog.
+ */
+void workers_watchdog(unsigned int seconds);
+
+#endif /* WORKERS_H_ */